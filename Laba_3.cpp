@@ -3,162 +3,6049 @@
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <deque>
+#include <functional>
+#include <algorithm>
+#include <string>
+#include <cstdlib>
+#include <chrono>
+#include <atomic>
+#include <memory>
+#include <cstdint>
 #include <vector>
 #include <filesystem>
+#include <cstring>
+#include <cstdio>
+#include <cmath>
+#include <array>
+#include <sstream>
+#include <limits>
+#include <stdexcept>
+#include <exception>
+#include <unordered_map>
+#include <list>
+#include <new>
+#include <utility>
+#include <csignal>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#if defined(__aarch64__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <climits>
+#include <ctime>
+// Необязательные библиотеки включаются явно, вместе с ключом компоновки:
+// -DUSE_IO_URING и -luring (--io-uring, только Linux), -DUSE_ZLIB и -lz (сжатые записи zip),
+// -DUSE_JPEG_DCT и -ljpeg (--jpeg-dct). Без них сборка не зависит от этих библиотек
+#if defined(USE_IO_URING) && defined(__linux__)
+#include <liburing.h>
+#define HAVE_IO_URING 1
+#endif
+#ifdef USE_ZLIB
+#include <zlib.h>
+#define HAVE_ZLIB 1
+#endif
+#include <dirent.h>
+#ifdef USE_JPEG_DCT
+#include <csetjmp>
+#include <jpeglib.h> // Нужен <cstdio> выше
+#define HAVE_JPEG 1
+#endif
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+#endif
 #include <opencv2/opencv.hpp> // Используем OpenCV для обработки изображений
 
 namespace fs = std::filesystem;
 
-// Блокирующая очередь
+// Блокирующая очередь с ограничением ёмкости
 template <typename T>
 class BlockingQueue {
 private:
     std::queue<T> queue;
+    std::mutex mutex;
+    std::condition_variable not_empty; // Сигнал для потребителей: в очереди появился элемент
+    std::condition_variable not_full;  // Сигнал для производителей: освободилось место
+    const size_t capacity;             // 0 означает очередь без ограничения
+    bool closed = false;
+
+    bool full() const {
+        return capacity != 0 && queue.size() >= capacity;
+    }
+
+public:
+    explicit BlockingQueue(size_t capacity = 0) : capacity(capacity) {}
+
+    // Конструирует элемент прямо в очереди: ждёт свободного места,
+    // возвращает false, если очередь закрыта
+    template <typename... Args>
+    bool emplace(Args&&... args) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            not_full.wait(lock, [this]() { return closed || !full(); });
+            if (closed) return false;
+            queue.emplace(std::forward<Args>(args)...); // Добавляем элемент в очередь
+        }
+        not_empty.notify_one(); // Уведомляем один из ожидающих потоков о наличии нового элемента
+        return true;
+    }
+
+    // Метод добавления элемента в очередь
+    bool push(const T& value) { return emplace(value); }
+    bool push(T&& value) { return emplace(std::move(value)); }
+
+    // Неблокирующее добавление: false, если очередь заполнена или закрыта
+    bool try_push(T value) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (closed || full()) return false;
+            queue.push(std::move(value));
+        }
+        not_empty.notify_one();
+        return true;
+    }
+
+    // Добавление с ожиданием не дольше timeout
+    template <typename Rep, typename Period>
+    bool push_for(T value, const std::chrono::duration<Rep, Period>& timeout) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (!not_full.wait_for(lock, timeout, [this]() { return closed || !full(); })) {
+                return false; // Место так и не освободилось
+            }
+            if (closed) return false;
+            queue.push(std::move(value));
+        }
+        not_empty.notify_one();
+        return true;
+    }
+
+    // Пакетное добавление: элементы перемещаются в очередь под одной блокировкой
+    // (при заполненной очереди — порциями по мере освобождения места).
+    // Возвращает число добавленных элементов, items очищается
+    size_t push_bulk(std::vector<T>& items) {
+        size_t pushed = 0;
+        while (pushed < items.size()) {
+            size_t portion = 0;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                not_full.wait(lock, [this]() { return closed || !full(); });
+                if (closed) break;
+                while (pushed < items.size() && !full()) {
+                    queue.push(std::move(items[pushed++]));
+                    ++portion;
+                }
+            }
+            if (portion == 1) {
+                not_empty.notify_one();
+            } else {
+                not_empty.notify_all();
+            }
+        }
+        items.clear();
+        return pushed;
+    }
+
+    // Извлечения элемента из очереди: false, если очередь закрыта и пуста
+    bool pop(T& value) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            not_empty.wait(lock, [this]() { return closed || !queue.empty(); }); // Ожидаем элемент или закрытие
+
+            if (queue.empty()) return false; // Очередь закрыта и все элементы разобраны
+
+            value = std::move(queue.front()); // Получаем элемент из начала очереди
+            queue.pop(); // Удаляем элемент из очереди
+        }
+        not_full.notify_one(); // Освободилось место для производителя
+        return true;
+    }
+
+    // Пакетное извлечение: ждёт хотя бы один элемент и забирает до max штук
+    // под одной блокировкой. false, если очередь закрыта и пуста
+    bool pop_bulk(std::vector<T>& out, size_t max) {
+        out.clear();
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            not_empty.wait(lock, [this]() { return closed || !queue.empty(); });
+
+            if (queue.empty()) return false;
+
+            while (!queue.empty() && out.size() < max) {
+                out.push_back(std::move(queue.front()));
+                queue.pop();
+            }
+        }
+        if (out.size() == 1) {
+            not_full.notify_one();
+        } else {
+            not_full.notify_all();
+        }
+        return true;
+    }
+
+    // Закрывает очередь: новые элементы не принимаются, ожидающие потоки будят,
+    // потребители дочитывают остаток и получают false
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+        }
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+
+    // Снова открывает закрытую и разобранную очередь (повторный прогон конвейера)
+    void reopen() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = false;
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return queue.size();
+    }
+};
+
+// Подсказка процессору внутри цикла активного ожидания
+inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    asm volatile("yield");
+#else
+    std::this_thread::yield();
+#endif
+}
+
+// Место парковки для ожидающих потоков: сначала поток крутится, затем засыпает
+// на condition_variable. Будящая сторона трогает мьютекс, только если кто-то спит
+class Parker {
+private:
     std::mutex mutex;
     std::condition_variable cond_var;
+    std::atomic<int> sleepers{0};
+
+    static constexpr int SPIN_ITERATIONS = 128; // Итераций с pause до уступки процессора
+    static constexpr int YIELD_ITERATIONS = 16; // Итераций с yield до парковки
+
+public:
+    // Ждёт, пока ready() не вернёт true. ready() должна быть безопасна для повторных вызовов
+    template <typename Ready>
+    void wait(Ready ready) {
+        for (int i = 0; i < SPIN_ITERATIONS; ++i) {
+            if (ready()) return;
+            cpuRelax();
+        }
+        for (int i = 0; i < YIELD_ITERATIONS; ++i) {
+            if (ready()) return;
+            std::this_thread::yield();
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            sleepers.fetch_add(1, std::memory_order_seq_cst);
+            if (ready()) {
+                sleepers.fetch_sub(1, std::memory_order_relaxed);
+                return;
+            }
+            cond_var.wait(lock);
+            sleepers.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+
+    void notify_one() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleepers.load(std::memory_order_seq_cst) == 0) return; // Никто не спит — мьютекс не трогаем
+        { std::lock_guard<std::mutex> lock(mutex); }
+        cond_var.notify_one();
+    }
+
+    void notify_all() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleepers.load(std::memory_order_seq_cst) == 0) return;
+        { std::lock_guard<std::mutex> lock(mutex); }
+        cond_var.notify_all();
+    }
+};
+
+// Неблокирующая ограниченная MPMC-очередь на кольцевом буфере (схема Вьюкова):
+// у каждой ячейки есть номер последовательности, по которому производители и
+// потребители понимают, свободна ли она. Интерфейс совпадает с BlockingQueue
+template <typename T>
+class LockFreeQueue {
+private:
+    static constexpr size_t CACHE_LINE = 64;
+
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+
+    const size_t mask;
+    std::unique_ptr<Cell[]> buffer;
+    alignas(CACHE_LINE) std::atomic<size_t> enqueue_pos{0}; // Голова и хвост в разных строках кэша,
+    alignas(CACHE_LINE) std::atomic<size_t> dequeue_pos{0}; // чтобы производители и потребители не мешали друг другу
+    alignas(CACHE_LINE) std::atomic<bool> closed{false};
+    Parker not_empty;
+    Parker not_full;
+
+    static size_t roundUpPow2(size_t n) {
+        size_t size = 2;
+        while (size < n) size <<= 1;
+        return size;
+    }
+
+    // Одна попытка положить элемент, false при заполненной очереди
+    bool tryEnqueue(T& value) {
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &buffer[pos & mask];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                return false; // Ячейка ещё занята потребителем — очередь полна
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        cell->data = std::move(value);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Одна попытка забрать элемент, false при пустой очереди
+    bool tryDequeue(T& value) {
+        size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &buffer[pos & mask];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0) {
+                if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                return false; // Производитель ещё не заполнил ячейку — очередь пуста
+            } else {
+                pos = dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        value = std::move(cell->data);
+        cell->sequence.store(pos + mask + 1, std::memory_order_release);
+        return true;
+    }
+
+public:
+    // Ёмкость округляется вверх до степени двойки; 0 заменяется значением по умолчанию,
+    // так как кольцевой буфер всегда ограничен
+    explicit LockFreeQueue(size_t capacity = 0)
+        : mask(roundUpPow2(capacity == 0 ? 1024 : capacity) - 1),
+          buffer(new Cell[mask + 1]) {
+        for (size_t i = 0; i <= mask; ++i) {
+            buffer[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    template <typename... Args>
+    bool emplace(Args&&... args) {
+        return push(T(std::forward<Args>(args)...));
+    }
+
+    bool push(const T& value) { return push(T(value)); }
+
+    // Ждёт свободного места, false если очередь закрыта
+    bool push(T&& value) {
+        bool pushed = false;
+        not_full.wait([&]() {
+            if (closed.load(std::memory_order_acquire)) return true;
+            pushed = tryEnqueue(value);
+            return pushed;
+        });
+        if (pushed) not_empty.notify_one();
+        return pushed;
+    }
+
+    bool try_push(T value) {
+        if (closed.load(std::memory_order_acquire) || !tryEnqueue(value)) return false;
+        not_empty.notify_one();
+        return true;
+    }
+
+    // Ожидание без парковки: крутимся и уступаем процессор до истечения timeout
+    template <typename Rep, typename Period>
+    bool push_for(T value, const std::chrono::duration<Rep, Period>& timeout) {
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        while (!closed.load(std::memory_order_acquire)) {
+            if (tryEnqueue(value)) {
+                not_empty.notify_one();
+                return true;
+            }
+            if (std::chrono::steady_clock::now() >= deadline) return false;
+            std::this_thread::yield();
+        }
+        return false;
+    }
+
+    size_t push_bulk(std::vector<T>& items) {
+        size_t pushed = 0;
+        for (auto& item : items) {
+            if (!push(std::move(item))) break;
+            ++pushed;
+        }
+        items.clear();
+        return pushed;
+    }
+
+    // Ждёт элемент; false, если очередь закрыта и пуста
+    bool pop(T& value) {
+        bool popped = false;
+        not_empty.wait([&]() {
+            if (tryDequeue(value)) {
+                popped = true;
+                return true;
+            }
+            if (closed.load(std::memory_order_acquire)) {
+                // После закрытия делаем ещё одну попытку, чтобы не потерять последний элемент
+                popped = tryDequeue(value);
+                return true;
+            }
+            return false;
+        });
+        if (popped) not_full.notify_one();
+        return popped;
+    }
+
+    bool pop_bulk(std::vector<T>& out, size_t max) {
+        out.clear();
+        T value;
+        if (!pop(value)) return false;
+        out.push_back(std::move(value));
+        while (out.size() < max && tryDequeue(value)) {
+            out.push_back(std::move(value));
+        }
+        if (out.size() > 1) not_full.notify_all();
+        return true;
+    }
+
+    void close() {
+        closed.store(true, std::memory_order_release);
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+
+    // Снова открывает закрытую и разобранную очередь (повторный прогон конвейера)
+    void reopen() { closed.store(false, std::memory_order_release); }
+
+    // Приблизительный размер: значения читаются без общей блокировки
+    size_t size() {
+        size_t tail = dequeue_pos.load(std::memory_order_relaxed);
+        size_t head = enqueue_pos.load(std::memory_order_relaxed);
+        return head > tail ? head - tail : 0;
+    }
+};
+
+// Выбор реализации очереди задач на этапе компиляции:
+// -DUSE_LOCKFREE_QUEUE включает LockFreeQueue вместо BlockingQueue
+#ifdef USE_LOCKFREE_QUEUE
+template <typename T>
+using TaskQueue = LockFreeQueue<T>;
+#else
+template <typename T>
+using TaskQueue = BlockingQueue<T>;
+#endif
+
+// Уровни журнала: по умолчанию — ошибки по отдельным файлам и итоговые сводки
+enum class LogLevel { Error, Warn, Info, Debug };
+
+// Асинхронный журнал. У каждого потока своя кольцевая очередь записей: пишет в неё только
+// сам поток, читает только фоновый поток журнала, поэтому на рабочей стороне нет ни
+// блокировок, ни ожидания консоли. Фоновый поток забирает записи порциями и выводит их
+// одним fwrite (ошибки и предупреждения в stderr, остальное в stdout). Если очередь
+// потока переполнена, запись не ждёт места, а теряется и учитывается в счётчике
+class Logger {
+private:
+    struct Record {
+        LogLevel level = LogLevel::Info;
+        std::string text;
+    };
+
+    struct Ring {
+        static constexpr size_t CAPACITY = 4096;
+        std::array<Record, CAPACITY> records;
+        alignas(64) std::atomic<size_t> head{0}; // Пишет владелец
+        alignas(64) std::atomic<size_t> tail{0}; // Пишет фоновый поток
+        std::atomic<uint64_t> dropped{0};
+    };
+
+    std::atomic<LogLevel> threshold{LogLevel::Info};
+    std::mutex mutex; // Только регистрация очередей и их перебор фоновым потоком
+    std::vector<std::shared_ptr<Ring>> rings;
+    std::vector<std::shared_ptr<Ring>> free_rings; // Очереди завершившихся потоков — для новых потоков
+    std::thread drainer;
+    std::atomic<bool> stopping{false};
+    uint64_t reported_drops = 0;
+
+    // Очередь закреплена за потоком до его завершения, потом достаётся следующему новому
+    // потоку: AutoTuner постоянно создаёт и снимает потоки стадий. Недовыведенные записи
+    // остаются в ней — head и tail продолжаются с тех же значений
+    class RingLease {
+    private:
+        Logger& owner;
+        std::shared_ptr<Ring> ring;
+
+    public:
+        explicit RingLease(Logger& owner) : owner(owner) {
+            std::lock_guard<std::mutex> lock(owner.mutex);
+            if (!owner.free_rings.empty()) {
+                ring = std::move(owner.free_rings.back());
+                owner.free_rings.pop_back();
+            } else {
+                ring = std::make_shared<Ring>();
+                owner.rings.push_back(ring);
+            }
+        }
+        ~RingLease() {
+            std::lock_guard<std::mutex> lock(owner.mutex);
+            owner.free_rings.push_back(std::move(ring));
+        }
+        Ring& get() { return *ring; }
+    };
+
+    Ring& local() {
+        thread_local RingLease lease(*this);
+        return lease.get();
+    }
+
+    // Переносит накопленное во всех очередях в консоль, возвращает число записей
+    size_t drain() {
+        std::vector<std::shared_ptr<Ring>> snapshot;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            snapshot = rings;
+        }
+        std::string out, err;
+        size_t drained = 0;
+        uint64_t drops = 0;
+        for (auto& ring : snapshot) {
+            size_t tail = ring->tail.load(std::memory_order_relaxed);
+            size_t head = ring->head.load(std::memory_order_acquire);
+            for (size_t i = tail; i != head; ++i) {
+                Record& record = ring->records[i % Ring::CAPACITY];
+                std::string& target = record.level <= LogLevel::Warn ? err : out;
+                target += record.text;
+                target += '\n';
+                record.text.clear();
+            }
+            ring->tail.store(head, std::memory_order_release);
+            drained += head - tail;
+            drops += ring->dropped.load(std::memory_order_relaxed);
+        }
+        if (drops != reported_drops) {
+            err += "[Log] " + std::to_string(drops - reported_drops) + " messages dropped (log buffer full)\n";
+            reported_drops = drops;
+        }
+        if (!out.empty()) {
+            std::fwrite(out.data(), 1, out.size(), stdout);
+            std::fflush(stdout);
+        }
+        if (!err.empty()) {
+            std::fwrite(err.data(), 1, err.size(), stderr);
+            std::fflush(stderr);
+        }
+        return drained;
+    }
+
+public:
+    bool enabled(LogLevel level) const { return level <= threshold.load(std::memory_order_relaxed); }
+    void setLevel(LogLevel level) { threshold.store(level, std::memory_order_relaxed); }
+
+    void submit(LogLevel level, std::string text) {
+        Ring& ring = local();
+        size_t head = ring.head.load(std::memory_order_relaxed);
+        if (head - ring.tail.load(std::memory_order_acquire) >= Ring::CAPACITY) {
+            ring.dropped.store(ring.dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return;
+        }
+        Record& record = ring.records[head % Ring::CAPACITY];
+        record.level = level;
+        record.text = std::move(text);
+        ring.head.store(head + 1, std::memory_order_release);
+    }
+
+    void start() {
+        drainer = std::thread([this] {
+            while (!stopping.load(std::memory_order_acquire)) {
+                if (drain() == 0) std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            }
+        });
+    }
+
+    // Дожидается вывода всего, что успели записать
+    void stop() {
+        stopping.store(true, std::memory_order_release);
+        if (drainer.joinable()) drainer.join();
+        drain();
+    }
+};
+
+Logger logger;
+
+// Строка журнала: собирается через <<, уходит в журнал в деструкторе.
+// Если уровень отключён, аргументы даже не форматируются
+class LogLine {
+private:
+    LogLevel level;
+    std::unique_ptr<std::ostringstream> stream;
+
+public:
+    explicit LogLine(LogLevel level) : level(level) {
+        if (logger.enabled(level)) stream = std::make_unique<std::ostringstream>();
+    }
+    LogLine(LogLine&&) = default;
+    ~LogLine() {
+        if (stream) logger.submit(level, stream->str());
+    }
+
+    template <typename T>
+    LogLine& operator<<(const T& value) {
+        if (stream) *stream << value;
+        return *this;
+    }
+};
+
+LogLine logLine(LogLevel level) {
+    return LogLine(level);
+}
+
+// Пул потоков с перехватом работы (work stealing): у каждого потока своя дека задач.
+// Поток берёт задачи из своей деки с конца (LIFO, горячий кэш), а когда она пуста —
+// крадёт у соседей с начала. Задачи, добавленные из рабочего потока (например,
+// фрагменты изображения), попадают в его собственную деку
+class ThreadPool {
+private:
+    struct Worker {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+    std::atomic<size_t> queued{0};      // Задачи, лежащие в деках
+    std::atomic<size_t> pending{0};     // Задачи, добавленные, но ещё не завершённые
+    std::atomic<size_t> next_worker{0}; // Для распределения внешних задач по кругу
+    std::atomic<bool> stopping{false};
+    const size_t max_pending;           // 0 — без ограничения на внешние submit
+    Parker work_available;
+    Parker space_available;
+    Parker idle;
+
+    static thread_local ThreadPool* current_pool;
+    static thread_local size_t current_index;
+
+    // Закрепление потока за ядром, пока поддерживается только в Linux
+    static void pinToCore(std::thread& thread, size_t index) {
+#ifdef __linux__
+        unsigned cores = std::thread::hardware_concurrency();
+        if (cores == 0) return;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(index % cores, &set);
+        pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+#else
+        (void)thread;
+        (void)index;
+#endif
+    }
+
+    // Ищет задачу: сначала в своей деке, затем у остальных потоков
+    bool findTask(size_t self, std::function<void()>& task) {
+        if (queued.load(std::memory_order_acquire) == 0) return false;
+        {
+            Worker& own = *workers[self];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                queued.fetch_sub(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        for (size_t i = 1; i < workers.size(); ++i) {
+            Worker& victim = *workers[(self + i) % workers.size()];
+            std::unique_lock<std::mutex> lock(victim.mutex, std::try_to_lock);
+            if (!lock.owns_lock() || victim.tasks.empty()) continue;
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            queued.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+        return false;
+    }
+
+    void runTask(std::function<void()>& task) {
+        try {
+            task();
+        } catch (const std::exception& e) {
+            logLine(LogLevel::Error) << "[Pool] Task failed: " << e.what();
+        } catch (...) { // Исключение не из std::exception не должно завершить процесс через std::terminate
+            logLine(LogLevel::Error) << "[Pool] Task failed with a non-standard exception";
+        }
+        task = nullptr;
+        size_t left = pending.fetch_sub(1, std::memory_order_acq_rel) - 1;
+        if (max_pending != 0 && left < max_pending) space_available.notify_one();
+        if (left == 0) idle.notify_all();
+    }
+
+    void workerLoop(size_t index) {
+        current_pool = this;
+        current_index = index;
+        std::function<void()> task;
+        while (true) {
+            work_available.wait([&]() {
+                return findTask(index, task) || stopping.load(std::memory_order_acquire);
+            });
+            if (!task) break; // Разбудили для остановки, а задач не осталось
+            runTask(task);
+        }
+    }
+
+public:
+    // num_threads == 0 — по числу аппаратных потоков
+    explicit ThreadPool(size_t num_threads, bool pin = false, size_t max_pending = 0)
+        : max_pending(max_pending) {
+        if (num_threads == 0) num_threads = std::max(1u, std::thread::hardware_concurrency());
+        for (size_t i = 0; i < num_threads; ++i) {
+            workers.push_back(std::make_unique<Worker>());
+        }
+        for (size_t i = 0; i < num_threads; ++i) {
+            threads.emplace_back(&ThreadPool::workerLoop, this, i);
+            if (pin) pinToCore(threads.back(), i);
+        }
+    }
+
+    ~ThreadPool() {
+        waitIdle();
+        stopping.store(true, std::memory_order_release);
+        work_available.notify_all();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Добавляет задачу. Из рабочего потока — в его деку без ожидания,
+    // из внешнего — по кругу, дожидаясь, пока незавершённых задач станет меньше max_pending
+    void submit(std::function<void()> task) {
+        bool internal = current_pool == this;
+        if (!internal && max_pending != 0) {
+            space_available.wait([this]() {
+                return pending.load(std::memory_order_acquire) < max_pending;
+            });
+        }
+        pending.fetch_add(1, std::memory_order_acq_rel);
+        size_t index = internal ? current_index
+                                : next_worker.fetch_add(1, std::memory_order_relaxed) % workers.size();
+        {
+            Worker& worker = *workers[index];
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            worker.tasks.push_back(std::move(task));
+        }
+        queued.fetch_add(1, std::memory_order_release);
+        work_available.notify_one();
+    }
+
+    // Выполняет задачи пула в текущем потоке, пока done() не вернёт true, а когда задач
+    // нет — спит до новой задачи или wake(). Для тех, кто ждёт подзадачи: ожидающий
+    // рабочий поток не простаивает и не занимает ядро впустую
+    template <typename Done>
+    void helpUntil(Done done) {
+        std::function<void()> task;
+        size_t self = current_pool == this ? current_index : 0;
+        while (!done()) {
+            work_available.wait([&]() { return done() || findTask(self, task); });
+            if (task) runTask(task);
+        }
+    }
+
+    // Будит ждущих в helpUntil: условие done() могло измениться
+    void wake() { work_available.notify_all(); }
+
+    // Ждёт завершения всех добавленных задач
+    void waitIdle() {
+        idle.wait([this]() { return pending.load(std::memory_order_acquire) == 0; });
+    }
+
+    size_t size() const { return workers.size(); }
+};
+
+thread_local ThreadPool* ThreadPool::current_pool = nullptr;
+thread_local size_t ThreadPool::current_index = 0;
+
+// Группа связанных задач (например, фрагментов одного изображения) с общим ожиданием.
+// Ожидающий поток помогает пулу выполнять задачи, а когда их нет — спит.
+// Первое исключение из задач группы wait() пробрасывает после завершения всех задач
+class TaskGroup {
+private:
+    ThreadPool& pool;
+    std::atomic<size_t> remaining{0};
+    std::mutex error_mutex;
+    std::exception_ptr error;
+
+    void drain() {
+        pool.helpUntil([this]() { return remaining.load(std::memory_order_acquire) == 0; });
+    }
+
+public:
+    explicit TaskGroup(ThreadPool& pool) : pool(pool) {}
+
+    ~TaskGroup() { drain(); } // Исключение, не забранное wait(), теряется
+
+    void run(std::function<void()> task) {
+        remaining.fetch_add(1, std::memory_order_relaxed);
+        ThreadPool& owner = pool; // После последнего fetch_sub группа может быть уже разрушена
+        pool.submit([this, &owner, task = std::move(task)]() {
+            try {
+                task();
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error) error = std::current_exception();
+            }
+            if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) owner.wake();
+        });
+    }
+
+    void wait() {
+        drain();
+        std::exception_ptr failed;
+        {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            failed = std::exchange(error, nullptr);
+        }
+        if (failed) std::rethrow_exception(failed);
+    }
+};
+
+// Ядра инверсии на месте: каждый байт буфера заменяется на x ^ 0xFF.
+// Для 8- и 16-битных изображений результат совпадает с cv::bitwise_not,
+// но без отдельного выходного кадра и второго прохода по памяти
+using InvertFn = void (*)(uchar* data, size_t size);
+
+struct InvertKernel {
+    const char* name;
+    InvertFn fn;
+};
+
+void invertScalar(uchar* data, size_t size) {
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        std::memcpy(&word, data + i, sizeof(word)); // memcpy — без проблем с выравниванием
+        word = ~word;
+        std::memcpy(data + i, &word, sizeof(word));
+    }
+    for (; i < size; ++i) {
+        data[i] = static_cast<uchar>(~data[i]);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+void invertAvx2(uchar* data, size_t size) {
+    const __m256i ones = _mm256_set1_epi8(-1);
+    size_t i = 0;
+    for (; i + 128 <= size; i += 128) { // Четыре регистра за итерацию
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + 32));
+        __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + 64));
+        __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + 96));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(data + i), _mm256_xor_si256(a, ones));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(data + i + 32), _mm256_xor_si256(b, ones));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(data + i + 64), _mm256_xor_si256(c, ones));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(data + i + 96), _mm256_xor_si256(d, ones));
+    }
+    for (; i + 32 <= size; i += 32) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(data + i), _mm256_xor_si256(a, ones));
+    }
+    invertScalar(data + i, size - i);
+}
+
+__attribute__((target("avx512f")))
+void invertAvx512(uchar* data, size_t size) {
+    const __m512i ones = _mm512_set1_epi32(-1);
+    size_t i = 0;
+    for (; i + 256 <= size; i += 256) {
+        __m512i a = _mm512_loadu_si512(data + i);
+        __m512i b = _mm512_loadu_si512(data + i + 64);
+        __m512i c = _mm512_loadu_si512(data + i + 128);
+        __m512i d = _mm512_loadu_si512(data + i + 192);
+        _mm512_storeu_si512(data + i, _mm512_xor_si512(a, ones));
+        _mm512_storeu_si512(data + i + 64, _mm512_xor_si512(b, ones));
+        _mm512_storeu_si512(data + i + 128, _mm512_xor_si512(c, ones));
+        _mm512_storeu_si512(data + i + 192, _mm512_xor_si512(d, ones));
+    }
+    for (; i + 64 <= size; i += 64) {
+        _mm512_storeu_si512(data + i, _mm512_xor_si512(_mm512_loadu_si512(data + i), ones));
+    }
+    invertScalar(data + i, size - i);
+}
+#endif
+
+#if defined(__aarch64__) || defined(__ARM_NEON)
+void invertNeon(uchar* data, size_t size) {
+    size_t i = 0;
+    for (; i + 64 <= size; i += 64) {
+        uint8x16x4_t v = vld1q_u8_x4(data + i);
+        v.val[0] = vmvnq_u8(v.val[0]);
+        v.val[1] = vmvnq_u8(v.val[1]);
+        v.val[2] = vmvnq_u8(v.val[2]);
+        v.val[3] = vmvnq_u8(v.val[3]);
+        vst1q_u8_x4(data + i, v);
+    }
+    for (; i + 16 <= size; i += 16) {
+        vst1q_u8(data + i, vmvnq_u8(vld1q_u8(data + i)));
+    }
+    invertScalar(data + i, size - i);
+}
+#endif
+
+// Все ядра, доступные на текущем процессоре, от лучшего к запасному
+std::vector<InvertKernel> availableInvertKernels() {
+    std::vector<InvertKernel> kernels;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) kernels.push_back({"avx512", invertAvx512});
+    if (__builtin_cpu_supports("avx2")) kernels.push_back({"avx2", invertAvx2});
+#endif
+#if defined(__aarch64__) || defined(__ARM_NEON)
+    kernels.push_back({"neon", invertNeon}); // NEON обязателен для aarch64
+#endif
+    kernels.push_back({"scalar", invertScalar});
+    return kernels;
+}
+
+// Ядро выбирается один раз при первом обращении
+const InvertKernel& invertKernel() {
+    static const InvertKernel kernel = availableInvertKernels().front();
+    return kernel;
+}
+
+// Инвертирует изображение на месте, построчно, если строки идут с разрывами
+void invertInPlace(cv::Mat& image, InvertFn invert) {
+    if (image.isContinuous()) {
+        invert(image.data, image.total() * image.elemSize());
+        return;
+    }
+    size_t row_bytes = static_cast<size_t>(image.cols) * image.elemSize();
+    for (int y = 0; y < image.rows; ++y) {
+        invert(image.ptr<uchar>(y), row_bytes);
+    }
+}
+
+void invertInPlace(cv::Mat& image) { invertInPlace(image, invertKernel().fn); }
+
+// Пул буферов для пикселей кадров. Подключается к cv::Mat как MatAllocator:
+// когда последний Mat, ссылающийся на буфер, освобождается, буфер возвращается
+// в пул и достаётся следующему кадру того же класса размера без malloc/free
+// и без новых page fault. Классы размеров — четверти степени двойки,
+// поэтому лишняя память на буфер не превышает 25%
+class FramePool : public cv::MatAllocator {
+private:
+    static constexpr size_t ALIGNMENT = 64;
+
+    mutable std::mutex mutex;
+    mutable std::unordered_map<size_t, std::vector<uchar*>> free_lists; // Класс размера → свободные буферы
+    mutable size_t cached_bytes = 0;  // Лежат в пуле
+    mutable size_t in_use_bytes = 0;  // Отданы кадрам
+    mutable size_t peak_bytes = 0;    // Максимум cached + in_use
+    size_t cache_limit = 1024ull * 1024 * 1024;
+    mutable std::atomic<uint64_t> hits{0};
+    mutable std::atomic<uint64_t> misses{0};
+
+    static size_t sizeClass(size_t size) {
+        if (size <= 4 * ALIGNMENT) return 4 * ALIGNMENT;
+        size_t top = size_t(1) << (63 - __builtin_clzll(size)); // Старшая степень двойки, не больше size
+        size_t step = top / 4;
+        return (size + step - 1) / step * step;
+    }
+
+    uchar* acquire(size_t size) const {
+        size_t bucket = sizeClass(size);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = free_lists.find(bucket);
+            if (it != free_lists.end() && !it->second.empty()) {
+                uchar* block = it->second.back();
+                it->second.pop_back();
+                cached_bytes -= bucket;
+                in_use_bytes += bucket;
+                hits.fetch_add(1, std::memory_order_relaxed);
+                return block;
+            }
+            in_use_bytes += bucket;
+            peak_bytes = std::max(peak_bytes, in_use_bytes + cached_bytes);
+        }
+        misses.fetch_add(1, std::memory_order_relaxed);
+        return static_cast<uchar*>(::operator new(bucket, std::align_val_t(ALIGNMENT)));
+    }
+
+    void release(uchar* block, size_t size) const {
+        size_t bucket = sizeClass(size);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            in_use_bytes -= bucket;
+            if (cached_bytes + bucket <= cache_limit) {
+                free_lists[bucket].push_back(block);
+                cached_bytes += bucket;
+                return;
+            }
+        }
+        ::operator delete(block, std::align_val_t(ALIGNMENT)); // Пул переполнен — отдаём память системе
+    }
+
+public:
+    struct Stats {
+        uint64_t hits, misses;
+        size_t cached_bytes, in_use_bytes, peak_bytes;
+        double hitRate() const { return hits + misses == 0 ? 0.0 : double(hits) / double(hits + misses); }
+    };
+
+    ~FramePool() override {
+        for (auto& list : free_lists) {
+            for (uchar* block : list.second) {
+                ::operator delete(block, std::align_val_t(ALIGNMENT));
+            }
+        }
+    }
+
+    // Сколько байт свободных буферов пул держит про запас
+    void setCacheLimit(size_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        cache_limit = bytes;
+    }
+
+    Stats stats() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return {hits.load(), misses.load(), cached_bytes, in_use_bytes, peak_bytes};
+    }
+
+    // Повторяет cv::StdMatAllocator, но берёт память из пула
+    cv::UMatData* allocate(int dims, const int* sizes, int type, void* data0, size_t* step,
+                           cv::AccessFlag, cv::UMatUsageFlags) const override {
+        size_t total = CV_ELEM_SIZE(type);
+        for (int i = dims - 1; i >= 0; --i) {
+            if (step) {
+                if (data0 && step[i] != CV_AUTOSTEP) {
+                    CV_Assert(total <= step[i]);
+                    total = step[i];
+                } else {
+                    step[i] = total;
+                }
+            }
+            total *= sizes[i];
+        }
+        cv::UMatData* u = new cv::UMatData(this);
+        u->data = u->origdata = data0 ? static_cast<uchar*>(data0) : acquire(total);
+        u->size = total;
+        if (data0) u->flags |= cv::UMatData::USER_ALLOCATED;
+        return u;
+    }
+
+    bool allocate(cv::UMatData* u, cv::AccessFlag, cv::UMatUsageFlags) const override {
+        return u != nullptr;
+    }
+
+    void deallocate(cv::UMatData* u) const override {
+        if (!u) return;
+        CV_Assert(u->urefcount == 0);
+        CV_Assert(u->refcount == 0);
+        if (!(u->flags & cv::UMatData::USER_ALLOCATED)) {
+            release(u->origdata, u->size);
+            u->origdata = nullptr;
+        }
+        delete u;
+    }
+};
+
+FramePool frame_pool;
+
+// Пустой Mat, который при create() возьмёт память из frame_pool.
+// Используется для всех кадров, создаваемых стадиями декодирования и преобразования
+cv::Mat pooledMat() {
+    cv::Mat mat;
+    mat.allocator = &frame_pool;
+    return mat;
+}
+
+// Пул байтовых буферов (содержимое входных файлов, закодированные результаты).
+// Возвращённые векторы сохраняют ёмкость, поэтому повторное чтение файла
+// похожего размера не трогает аллокатор
+class BytePool {
+private:
+    static constexpr size_t MAX_BUFFERS = 64;              // Сколько свободных буферов хранить
+    static constexpr size_t MAX_BUFFER_BYTES = 64u << 20;  // Буферы крупнее не кэшируются
+
+    std::mutex mutex;
+    std::vector<std::vector<uchar>> buffers;
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+
+public:
+    // Буфер размера size (содержимое не инициализируется заново, если ёмкости хватает)
+    std::vector<uchar> acquire(size_t size) {
+        std::vector<uchar> buffer;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            // Берём самый маленький из подходящих по ёмкости
+            auto best = buffers.end();
+            for (auto it = buffers.begin(); it != buffers.end(); ++it) {
+                if (it->capacity() >= size && (best == buffers.end() || it->capacity() < best->capacity())) {
+                    best = it;
+                }
+            }
+            if (best != buffers.end()) {
+                buffer = std::move(*best);
+                *best = std::move(buffers.back());
+                buffers.pop_back();
+            }
+        }
+        (buffer.capacity() >= size ? hits : misses).fetch_add(1, std::memory_order_relaxed);
+        buffer.resize(size);
+        return buffer;
+    }
+
+    void release(std::vector<uchar>&& buffer) {
+        if (buffer.capacity() == 0 || buffer.capacity() > MAX_BUFFER_BYTES) return;
+        buffer.clear();
+        std::lock_guard<std::mutex> lock(mutex);
+        if (buffers.size() < MAX_BUFFERS) buffers.push_back(std::move(buffer));
+    }
+
+    double hitRate() const {
+        uint64_t h = hits.load(), m = misses.load();
+        return h + m == 0 ? 0.0 : double(h) / double(h + m);
+    }
+};
+
+BytePool byte_pool;
+
+// Глобальный бюджет памяти на декодированные кадры в обработке: декодер заранее
+// резервирует оценку размера кадра и ждёт, пока бюджета не хватает. Кадр крупнее всего
+// бюджета пропускается, когда других в обработке нет, — иначе он не прошёл бы никогда
+class MemoryBudget {
+private:
+    std::mutex mutex;
+    std::condition_variable freed;
+    size_t limit = 0; // 0 — без ограничения
+    size_t used = 0;
+    size_t peak = 0;
+
+public:
+    void setLimit(size_t bytes) { limit = bytes; }
+    bool limited() const { return limit != 0; }
+
+    void acquire(size_t bytes) {
+        std::unique_lock<std::mutex> lock(mutex);
+        freed.wait(lock, [&] { return used == 0 || used + bytes <= limit; });
+        used += bytes;
+        peak = std::max(peak, used);
+    }
+
+    void release(size_t bytes) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            used -= bytes;
+        }
+        freed.notify_all();
+    }
+
+    size_t peakBytes() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return peak;
+    }
+};
+
+MemoryBudget memory_budget;
+
+// Доля memory_budget, занятая заданием: возвращается в release() или при уничтожении
+// задания (например, отброшенного стадией)
+class MemoryTicket {
+private:
+    size_t bytes = 0;
+
+public:
+    MemoryTicket() = default;
+    explicit MemoryTicket(size_t bytes) : bytes(bytes) {}
+    MemoryTicket(MemoryTicket&& other) noexcept : bytes(std::exchange(other.bytes, 0)) {}
+    MemoryTicket& operator=(MemoryTicket&& other) noexcept {
+        if (this != &other) {
+            release();
+            bytes = std::exchange(other.bytes, 0);
+        }
+        return *this;
+    }
+    ~MemoryTicket() { release(); }
+
+    void release() {
+        if (bytes != 0) memory_budget.release(bytes);
+        bytes = 0;
+    }
+};
+
+// Аренда заданий у координатора (режим --worker). Задания держат её через LeaseSlot;
+// когда уничтожено последнее из них, деструктор передаёт итог — какие сохранены — в report
+struct RemoteLease {
+    uint64_t id = 0;
+    std::vector<char> saved;      // Пишут разные потоки, но каждый — свой элемент
+    std::vector<uint64_t> hashes; // XXH64 входа для манифеста координатора, 0 — не вычислялся
+    std::function<void(const RemoteLease&)> report;
+
+    ~RemoteLease() {
+        if (report) report(*this);
+    }
+};
+
+// Место задания в аренде; пустое, если задание не из аренды
+class LeaseSlot {
+private:
+    std::shared_ptr<RemoteLease> lease;
+    size_t index = 0;
+
+public:
+    LeaseSlot() = default;
+    LeaseSlot(std::shared_ptr<RemoteLease> lease, size_t index) : lease(std::move(lease)), index(index) {}
+
+    void succeed(uint64_t hash) {
+        if (!lease) return;
+        lease->saved[index] = 1;
+        lease->hashes[index] = hash;
+    }
+};
+
+// Файл, отображённый в память только для чтения; отображение снимается в деструкторе
+class MappedFile {
+private:
+    void* address = nullptr;
+    size_t length = 0;
+
+public:
+    MappedFile(void* address, size_t length) : address(address), length(length) {}
+    ~MappedFile() {
+        if (address) munmap(address, length);
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const uchar* data() const { return static_cast<const uchar*>(address); }
+    size_t size() const { return length; }
+};
+
+// Отображает открытый файл целиком; nullptr, если отобразить не удалось
+std::shared_ptr<MappedFile> mapFile(int fd, size_t size) {
+    if (size == 0) return nullptr;
+    void* address = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (address == MAP_FAILED) return nullptr;
+    madvise(address, size, MADV_SEQUENTIAL); // Файл читается от начала к концу
+    madvise(address, size, MADV_WILLNEED);
+    return std::make_shared<MappedFile>(address, size);
+}
+
+// Просит ядро заранее начать чтение файла целиком, не дожидаясь обращения
+void adviseWillNeed(int fd, size_t size) {
+#ifdef __linux__
+    posix_fadvise(fd, 0, static_cast<off_t>(size), POSIX_FADV_WILLNEED);
+#elif defined(__APPLE__)
+    radvisory advice;
+    advice.ra_offset = 0;
+    advice.ra_count = static_cast<int>(std::min<size_t>(size, std::numeric_limits<int>::max()));
+    fcntl(fd, F_RDADVISE, &advice);
+#else
+    (void)fd;
+    (void)size;
+#endif
+}
+
+// Сведения из заголовка изображения, прочитанные без декодирования
+struct ImageProbe {
+    enum class Format { Unknown, Jpeg, Png };
+    Format format = Format::Unknown; // Unknown — заголовок не читался или не разобран
+    cv::Size size;
+    int channels = 0;          // Каналов после декодирования
+    int bytes_per_channel = 1;
+    bool supported = false;    // Заголовок цел, и декодер умеет такой вариант формата
+
+    // Байты декодированного кадра в полном размере
+    uint64_t decodedBytes() const { return uint64_t(size.width) * size.height * channels * bytes_per_channel; }
+};
+
+// Заголовок кадра JPEG (SOFn). Иерархические кадры и точность не 8 бит декодер не поддерживает
+bool probeJpeg(const uchar* data, size_t size, ImageProbe& probe) {
+    if (size < 4 || data[0] != 0xFF || data[1] != 0xD8) return false;
+    size_t pos = 2;
+    while (pos + 4 <= size) {
+        if (data[pos] != 0xFF) return false;
+        uchar marker = data[pos + 1];
+        if (marker == 0xFF) { // Заполняющий байт
+            ++pos;
+            continue;
+        }
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD9)) { // Маркеры без длины
+            pos += 2;
+            continue;
+        }
+        size_t length = (static_cast<size_t>(data[pos + 2]) << 8) | data[pos + 3];
+        bool frame = marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC;
+        if (frame) {
+            if (pos + 10 > size || length < 8) return false;
+            int precision = data[pos + 4];
+            int components = data[pos + 9];
+            probe.size.height = (data[pos + 5] << 8) | data[pos + 6];
+            probe.size.width = (data[pos + 7] << 8) | data[pos + 8];
+            if (probe.size.width <= 0 || probe.size.height <= 0) return false;
+            probe.format = ImageProbe::Format::Jpeg;
+            probe.channels = components == 1 ? 1 : 3; // CMYK OpenCV тоже отдаёт как BGR
+            probe.bytes_per_channel = 1;
+            bool hierarchical = (marker >= 0xC5 && marker <= 0xC7) || marker >= 0xCD;
+            probe.supported = !hierarchical && precision == 8 && (components == 1 || components == 3 || components == 4);
+            return true;
+        }
+        if (marker == 0xDA) return false; // Данные скана раньше заголовка кадра
+        pos += 2 + length;
+    }
+    return false;
+}
+
+// IHDR PNG: каналы после декодирования с IMREAD_UNCHANGED и байты на канал
+bool probePng(const uchar* data, size_t size, ImageProbe& probe) {
+    static const uchar SIGNATURE[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    if (size < 29 || std::memcmp(data, SIGNATURE, 8) != 0 || std::memcmp(data + 12, "IHDR", 4) != 0) return false;
+    auto be32 = [&](size_t pos) {
+        return (uint32_t(data[pos]) << 24) | (uint32_t(data[pos + 1]) << 16) | (uint32_t(data[pos + 2]) << 8) | data[pos + 3];
+    };
+    if (be32(8) != 13) return false;
+    uint32_t width = be32(16), height = be32(20);
+    if (width == 0 || height == 0 || width > INT32_MAX || height > INT32_MAX) return false;
+    int depth = data[24];
+    bool valid_depth;
+    switch (data[25]) { // Тип цвета и допустимые для него глубины
+    case 0: probe.channels = 1; valid_depth = depth == 1 || depth == 2 || depth == 4 || depth == 8 || depth == 16; break;
+    case 2: probe.channels = 3; valid_depth = depth == 8 || depth == 16; break;
+    case 3: probe.channels = 3; valid_depth = depth == 1 || depth == 2 || depth == 4 || depth == 8; break; // Палитра разворачивается в BGR
+    case 4: case 6: probe.channels = 4; valid_depth = depth == 8 || depth == 16; break;
+    default: return false;
+    }
+    if (!valid_depth || data[26] != 0 || data[27] != 0 || data[28] > 1) return false; // Сжатие, фильтр, чересстрочность
+    probe.format = ImageProbe::Format::Png;
+    probe.size = cv::Size(static_cast<int>(width), static_cast<int>(height));
+    probe.bytes_per_channel = depth == 16 ? 2 : 1;
+    probe.supported = true;
+    return true;
+}
+
+// Разбирает заголовок по первым байтам файла. false — заголовок повреждён, обрезан
+// или формат не поддерживается (тогда probe.format уже не Unknown)
+bool probeImage(const uchar* data, size_t size, ImageProbe& probe) {
+    probe = ImageProbe();
+    return (probeJpeg(data, size, probe) || probePng(data, size, probe)) && probe.supported;
+}
+
+// Файл начинается с сигнатуры JPEG или PNG — заголовок разбирается probeImage
+bool hasImageSignature(const uchar* data, size_t size) {
+    static const uchar PNG_SIGNATURE[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    return (size >= 3 && data[0] == 0xFF && data[1] == 0xD8 && data[2] == 0xFF)
+        || (size >= 8 && std::memcmp(data, PNG_SIGNATURE, 8) == 0);
+}
+
+// Начало сообщения об ошибке для отвергнутого probeImage файла
+const char* probeFailure(const ImageProbe& probe) {
+    return probe.format == ImageProbe::Format::Unknown ? "Corrupt or truncated image header: " : "Unsupported image variant: ";
+}
+
+// Заголовок файла без чтения его целиком: обычно SOFn и IHDR лежат в первых килобайтах,
+// а JPEG с крупным EXIF или встроенной миниатюрой дочитывается по второму разу
+bool probeFile(int dir_fd, const char* name, size_t size, ImageProbe& probe) {
+    static constexpr size_t FIRST_READ = 16 * 1024, SECOND_READ = 256 * 1024;
+    int fd = openat(dir_fd, name, O_RDONLY);
+    if (fd < 0) return false;
+    std::vector<uchar> head;
+    bool ok = false;
+    for (size_t want : { FIRST_READ, SECOND_READ }) {
+        want = std::min(want, size);
+        if (want <= head.size()) break; // Файл уже прочитан целиком
+        size_t done = head.size();
+        head.resize(want);
+        while (done < want) {
+            ssize_t n = pread(fd, head.data() + done, want - done, static_cast<off_t>(done));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            done += static_cast<size_t>(n);
+        }
+        head.resize(done);
+        ok = probeImage(head.data(), head.size(), probe);
+        if (ok || probe.format != ImageProbe::Format::Unknown || done < want) break;
+    }
+    close(fd);
+    return ok;
+}
+
+// Константы
+const std::string INPUT_DIR = "input_images";
+const std::string OUTPUT_DIR = "output_images";
+const size_t QUEUE_CAPACITY = 1024; // Сколько задач producer может опередить потребителей
+const size_t STAGE_QUEUE_CAPACITY = 16; // Ёмкость очередей между стадиями (в них уже лежат пиксели)
+const size_t PRODUCER_BATCH = 64;    // Сколько задач producer отправляет в очередь за раз
+const size_t CONSUMER_BATCH = 8;     // Сколько задач стадия забирает за одно пробуждение
+const size_t TILE_BYTES = 256 * 1024; // Размер полосы по умолчанию — чтобы она помещалась в L2
+const size_t MMAP_THRESHOLD = 128 * 1024; // Файлы меньше читаются read() в буфер из пула, больше — mmap
+const size_t GPU_MIN_PIXELS = 512 * 512; // Кадры меньше не окупают передачу на GPU и обратно
+
+// Параметры запуска из командной строки
+struct Options {
+    size_t num_threads = 0; // Потоки стадии преобразования (пул), 0 — по числу аппаратных потоков
+    bool pin_threads = false;
+    size_t readers = 2;     // Потоки стадии чтения файлов
+    size_t decoders = 0;    // Потоки декодирования, 0 — половина аппаратных потоков
+    size_t encoders = 0;    // Потоки кодирования, 0 — половина аппаратных потоков
+    size_t writers = 2;     // Потоки записи файлов
+    size_t tile_rows = 0;   // Строк в полосе при разбиении, 0 — подбирать по TILE_BYTES
+    size_t tile_threshold = 16 * 1000 * 1000; // Изображения крупнее (в пикселях) делятся на полосы
+    std::string ops = "invert"; // Цепочка преобразований, см. TransformChain
+    size_t pool_mb = 1024;      // Сколько мегабайт свободных буферов кадров держать в пуле
+    size_t readahead = 16;      // Сколько следующих файлов из очереди читатель просит ядро подгрузить
+    bool use_mmap = true;
+    bool use_io_uring = false;  // Асинхронное чтение и запись через io_uring (только Linux)
+    size_t write_batch = 32;    // Сколько результатов писатель сохраняет за раз
+    std::string fsync = "none"; // none | file | batch
+    bool direct_io = false;     // Запись в обход страничного кэша (O_DIRECT / F_NOCACHE)
+    std::string output_format = "files"; // files | tar | pack
+    size_t shard_mb = 4096;     // Размер шарда архива
+    std::string input = INPUT_DIR; // Каталог с изображениями или шард архива (.tar, .pack, .zip)
+    size_t scanners = 0;        // Потоки обхода входного каталога, 0 — четверть аппаратных потоков
+    std::string incremental = "off"; // off | stat | hash: пропускать входы, не изменившиеся с прошлого запуска
+    bool resume = false;        // Продолжить прерванный запуск по журналу (включает --incremental stat)
+    bool watch = false;         // После обхода следить за входом и обрабатывать новые файлы до SIGINT/SIGTERM
+    size_t watch_settle_ms = 100; // Сколько файл должен не меняться, прежде чем уйти в работу
+    size_t watch_interval = 2;  // Период обхода в секундах, если inotify недоступен
+    bool dedupe = false;        // Кэш результатов по содержимому входа
+    bool jpeg_dct = false;      // Инверсия JPEG прямо в коэффициентах DCT, без декодирования и перекодирования
+    std::string gpu = "off";    // off | opencl: преобразования на GPU, CPU — запасной путь для каждого кадра
+    unsigned coordinator_port = 0; // --coordinator PORT: раздавать задания работникам вместо обработки
+    std::string worker;         // --worker HOST:PORT: брать задания у координатора вместо обхода входа
+    size_t lease_batch = PRODUCER_BATCH; // Заданий в одной аренде
+    size_t lease_seconds = 120; // Срок аренды без вестей от работника, затем задания передаются другим
+    size_t metrics_interval = 10; // Период сводки метрик в секундах, 0 — только итоговая
+    std::string metrics_file;   // Куда выгружать метрики (.json или текст Prometheus)
+    LogLevel log_level = LogLevel::Info; // Info: ошибки по файлам и сводки, Debug: строка на каждый файл
+    size_t stage_queue = STAGE_QUEUE_CAPACITY; // Ёмкость очередей между стадиями
+    bool autotune = true;       // Подстройка числа потоков стадий во время работы (AutoTuner)
+    std::string schedule = "lpt"; // lpt — сначала крупные файлы (в пределах окна), fifo — в порядке обхода
+    size_t schedule_window = 4096; // Сколько заданий планировщик может придержать для упорядочивания
+    size_t memory_mb = 0;       // Бюджет памяти на декодированные кадры в обработке, 0 — без ограничения
+    bool probe = false;         // Сканер читает заголовки: стоимость по размеру кадра, битые файлы отсеиваются при обходе
+    std::string generate;       // Каталог для синтетического набора изображений (--generate)
+    size_t gen_count = 1000;
+    std::string gen_sizes = "64x64*70,640x480*20,1920x1080*8,7680x4320*2"; // Размеры с весами
+    std::string gen_formats = "jpg,png";
+    std::string bench;          // Файл результатов --bench (JSON Lines), "-" — stdout
+    std::string bench_threads;  // Числа потоков для сквозных прогонов, по умолчанию 1, 2, 4 … ядра
+    std::string bench_queues = "4,16,64"; // Ёмкости очередей между стадиями для сквозных прогонов
+    bool self_check = false;    // Сверить ядра инверсии с cv::bitwise_not и выйти (--self-check)
+    size_t cache_mb = 64;       // Бюджет LRU закодированных результатов в памяти, 0 — только ссылки
+};
+
+Options options;
+
+// Задание, проходящее через все стадии конвейера
+struct Job {
+    std::string name;        // Имя входного файла
+    std::string input_path;  // Полный путь к входному файлу
+    std::string output_path; // Куда сохранить результат
+    std::vector<uchar> bytes;   // Содержимое входного файла (после чтения), если оно не отображено
+    std::shared_ptr<MappedFile> mapping; // Отображённый в память входной файл или шард архива
+    size_t input_offset = 0;    // Где в отображении начинаются входные байты
+    size_t input_length = 0;    // Сколько их
+    size_t inflated_size = 0;   // Для сжатых записей zip — размер после распаковки
+    bool archived = false;      // Запись архива: байты уже указывают в отображённый шард
+    cv::Mat image;              // Пиксели (после декодирования и преобразования)
+    std::vector<uchar> encoded; // Закодированный результат (после кодирования)
+    bool saved = false;         // Результат записан (выставляет OutputSink)
+    uint64_t source_size = 0;   // Размер входа: для манифеста и как оценка стоимости, пока нет probe
+    int64_t source_mtime = 0;
+    uint64_t source_hash = 0;
+    uint64_t cache_key = 0;     // Ключ кэша результатов, 0 — не вычислялся
+    bool pre_encoded = false;   // encoded уже готов (кэш результатов, инверсия в DCT) — преобразование и кодирование пропускаются
+    std::string link_source;    // Уже сохранённый такой же результат — писатель ставит на него жёсткую ссылку
+    MemoryTicket memory;        // Доля memory_budget под декодированный кадр
+    ImageProbe probe;           // Заголовок: из сканера (--probe) или после чтения
+    LeaseSlot lease;            // Аренда координатора, из которой пришло задание (--worker)
+
+    // Оценка стоимости для TaskScheduler: размер кадра, если заголовок уже разобран
+    uint64_t cost() const { return probe.supported ? probe.decodedBytes() : source_size; }
+
+    // Входные байты без копирования — либо из отображения, либо из буфера
+    const uchar* inputData() const { return mapping ? mapping->data() + input_offset : bytes.data(); }
+    size_t inputSize() const { return mapping ? input_length : bytes.size(); }
+
+
+    void releaseInput() {
+        mapping.reset();
+        byte_pool.release(std::move(bytes));
+        bytes = std::vector<uchar>();
+    }
+
+    // Отброшенное стадией задание остаётся в порции потока до следующего pop_bulk —
+    // его кадр и доля бюджета памяти возвращаются сразу, иначе следующий acquire() может ждать вечно
+    void releaseResources() {
+        releaseInput();
+        image.release();
+        byte_pool.release(std::move(encoded));
+        encoded = std::vector<uchar>();
+        memory.release();
+    }
+};
+
+using JobQueue = TaskQueue<Job>;
+
+// Очереди
+JobQueue task_queue(QUEUE_CAPACITY);
+
+// Что измеряется: обход каталогов и стадии конвейера
+enum class Metric { Scan, Read, Decode, Transform, Encode, Write, Count };
+
+const char* metricName(Metric metric) {
+    static const char* names[] = { "scan", "read", "decode", "transform", "encode", "write" };
+    return names[static_cast<size_t>(metric)];
+}
+
+// Гистограмма задержек в наносекундах с логарифмическими корзинами (как в HDR Histogram):
+// 16 подкорзин на каждую степень двойки, погрешность квантилей около 6%.
+// Пишет только поток-владелец, поэтому хватает relaxed load/store без атомарного RMW
+class LatencyHistogram {
+public:
+    static constexpr size_t SUB_BUCKETS = 16;
+    static constexpr size_t BUCKETS = (64 - 3) * SUB_BUCKETS;
+
+    static size_t bucketOf(uint64_t value) {
+        if (value < SUB_BUCKETS) return static_cast<size_t>(value);
+        int exponent = 63 - __builtin_clzll(value);
+        return (exponent - 3) * SUB_BUCKETS + ((value >> (exponent - 4)) & (SUB_BUCKETS - 1));
+    }
+
+    // Середина корзины — её значение в квантилях
+    static double bucketValue(size_t bucket) {
+        if (bucket < SUB_BUCKETS) return static_cast<double>(bucket);
+        int exponent = static_cast<int>(bucket / SUB_BUCKETS) + 3;
+        double width = std::ldexp(1.0, exponent - 4);
+        return (SUB_BUCKETS + bucket % SUB_BUCKETS) * width + width / 2;
+    }
+
+    void record(uint64_t value) {
+        bump(counts[bucketOf(value)], 1);
+        bump(total, value);
+    }
+
+    void addTo(std::vector<uint64_t>& merged, uint64_t& sum) const {
+        for (size_t i = 0; i < BUCKETS; ++i) merged[i] += counts[i].load(std::memory_order_relaxed);
+        sum += total.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::array<std::atomic<uint64_t>, BUCKETS> counts{};
+    std::atomic<uint64_t> total{0}; // Сумма значений
+
+    static void bump(std::atomic<uint64_t>& counter, uint64_t delta) {
+        counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+};
+
+// Метрики конвейера. У каждого потока свои счётчики и гистограммы (время обработки и
+// ожидания входной очереди по стадиям), отчёт сливает их все — на горячем пути нет ни
+// блокировок, ни общих кэш-линий. Раз в metrics_interval секунд печатается сводка за
+// интервал, в конце — за весь запуск; с --metrics-file она же пишется в файл
+// (JSON, если имя оканчивается на .json, иначе текстовый формат Prometheus)
+class Metrics {
+public:
+    struct ThreadMetrics {
+        std::array<LatencyHistogram, static_cast<size_t>(Metric::Count)> latency;
+        std::array<LatencyHistogram, static_cast<size_t>(Metric::Count)> wait;
+        std::atomic<uint64_t> images{0}, bytes_in{0}, bytes_out{0}, dropped{0};
+    };
+
+    ThreadMetrics& local() {
+        thread_local ThreadLease mine(*this); // Сами значения переживают поток: их держит registry
+        return mine.get();
+    }
+
+    void record(Metric metric, uint64_t ns) { local().latency[static_cast<size_t>(metric)].record(ns); }
+    void recordWait(Metric metric, uint64_t ns) { local().wait[static_cast<size_t>(metric)].record(ns); }
+    void count(std::atomic<uint64_t> ThreadMetrics::*counter, uint64_t delta = 1) {
+        auto& value = local().*counter;
+        value.store(value.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+
+    void watchQueue(const std::string& name, std::function<size_t()> depth) {
+        std::lock_guard<std::mutex> lock(mutex);
+        queues.emplace_back(name, std::move(depth));
+    }
+
+    void start(size_t interval_seconds, const std::string& dump_path) {
+        stopping = false;
+        dump = dump_path;
+        started = previous_time = std::chrono::steady_clock::now();
+        previous = snapshot();
+        if (interval_seconds == 0) return;
+        reporter = std::thread([this, interval_seconds] {
+            std::unique_lock<std::mutex> lock(stop_mutex);
+            while (!stop_cv.wait_for(lock, std::chrono::seconds(interval_seconds), [this] { return stopping; })) {
+                report(false);
+            }
+        });
+    }
+
+    // Итоговая сводка за весь запуск; очереди из watchQueue после этого не опрашиваются
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(stop_mutex);
+            stopping = true;
+        }
+        stop_cv.notify_all();
+        if (reporter.joinable()) reporter.join();
+        report(true);
+        std::lock_guard<std::mutex> lock(mutex);
+        queues.clear();
+    }
+
+    // Сохранённые результаты с начала работы процесса (для замеров --bench)
+    uint64_t images() { return snapshot().images; }
+
+    // Накопленные значения одной строкой (гистограммы — только непустые корзины):
+    // так работник передаёт свои метрики координатору
+    std::string serialize() {
+        Snapshot current = snapshot();
+        std::ostringstream out;
+        out << current.images << ' ' << current.bytes_in << ' ' << current.bytes_out << ' ' << current.dropped;
+        auto histogram = [&](const std::vector<uint64_t>& counts, uint64_t sum) {
+            out << ' ' << sum << ' ' << std::count_if(counts.begin(), counts.end(), [](uint64_t c) { return c != 0; });
+            for (size_t b = 0; b < counts.size(); ++b) {
+                if (counts[b] != 0) out << ' ' << b << ' ' << counts[b];
+            }
+        };
+        for (size_t m = 0; m < current.latency.size(); ++m) {
+            histogram(current.latency[m], current.latency_sum[m]);
+            histogram(current.wait[m], current.wait_sum[m]);
+        }
+        return out.str();
+    }
+
+    // Итоги работника из serialize() заменяют его прошлые итоги и входят во все отчёты
+    bool merge(const std::string& worker, const std::string& text) {
+        Snapshot remote_snapshot;
+        std::istringstream in(text);
+        in >> remote_snapshot.images >> remote_snapshot.bytes_in >> remote_snapshot.bytes_out >> remote_snapshot.dropped;
+        auto histogram = [&](std::vector<uint64_t>& counts, uint64_t& sum) {
+            size_t filled = 0;
+            if (!(in >> sum >> filled)) return false;
+            for (size_t i = 0; i < filled; ++i) {
+                size_t bucket = 0;
+                uint64_t count = 0;
+                if (!(in >> bucket >> count) || bucket >= counts.size()) return false;
+                counts[bucket] = count;
+            }
+            return true;
+        };
+        for (size_t m = 0; m < remote_snapshot.latency.size(); ++m) {
+            if (!histogram(remote_snapshot.latency[m], remote_snapshot.latency_sum[m])
+                || !histogram(remote_snapshot.wait[m], remote_snapshot.wait_sum[m])) {
+                return false;
+            }
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        remote[worker] = std::move(remote_snapshot);
+        return true;
+    }
+
+private:
+    struct Snapshot {
+        std::vector<std::vector<uint64_t>> latency, wait;
+        std::vector<uint64_t> latency_sum, wait_sum;
+        uint64_t images = 0, bytes_in = 0, bytes_out = 0, dropped = 0;
+
+        Snapshot() : latency(static_cast<size_t>(Metric::Count), std::vector<uint64_t>(LatencyHistogram::BUCKETS)),
+                     wait(latency), latency_sum(latency.size()), wait_sum(latency.size()) {}
+
+        void add(const Snapshot& other) {
+            for (size_t m = 0; m < latency.size(); ++m) {
+                for (size_t b = 0; b < LatencyHistogram::BUCKETS; ++b) {
+                    latency[m][b] += other.latency[m][b];
+                    wait[m][b] += other.wait[m][b];
+                }
+                latency_sum[m] += other.latency_sum[m];
+                wait_sum[m] += other.wait_sum[m];
+            }
+            images += other.images;
+            bytes_in += other.bytes_in;
+            bytes_out += other.bytes_out;
+            dropped += other.dropped;
+        }
+
+        Snapshot minus(const Snapshot& earlier) const {
+            Snapshot delta = *this;
+            for (size_t m = 0; m < latency.size(); ++m) {
+                for (size_t b = 0; b < LatencyHistogram::BUCKETS; ++b) {
+                    delta.latency[m][b] -= earlier.latency[m][b];
+                    delta.wait[m][b] -= earlier.wait[m][b];
+                }
+                delta.latency_sum[m] -= earlier.latency_sum[m];
+                delta.wait_sum[m] -= earlier.wait_sum[m];
+            }
+            delta.images -= earlier.images;
+            delta.bytes_in -= earlier.bytes_in;
+            delta.bytes_out -= earlier.bytes_out;
+            delta.dropped -= earlier.dropped;
+            return delta;
+        }
+    };
+
+    std::mutex mutex;        // registry, free_slots, queues и remote
+    std::mutex report_mutex; // previous, previous_time и файл дампа
+    std::vector<std::shared_ptr<ThreadMetrics>> registry;
+    std::unordered_map<std::string, Snapshot> remote; // Последние итоги работников (Metrics::merge)
+    std::vector<std::pair<std::string, std::function<size_t()>>> queues;
+    std::string dump;
+    std::chrono::steady_clock::time_point started, previous_time;
+    Snapshot previous;
+    std::thread reporter;
+    std::mutex stop_mutex;
+    std::condition_variable stop_cv;
+    bool stopping = false;
+
+    std::vector<std::shared_ptr<ThreadMetrics>> free_slots; // Блоки завершившихся потоков
+
+    // Блок завершившегося потока переходит к следующему новому потоку вместе с
+    // накопленными значениями: итоги не меняются, а registry не растёт при grow()/shrink()
+    class ThreadLease {
+    private:
+        Metrics& owner;
+        std::shared_ptr<ThreadMetrics> slot;
+
+    public:
+        explicit ThreadLease(Metrics& owner) : owner(owner) {
+            std::lock_guard<std::mutex> lock(owner.mutex);
+            if (!owner.free_slots.empty()) {
+                slot = std::move(owner.free_slots.back());
+                owner.free_slots.pop_back();
+            } else {
+                slot = std::make_shared<ThreadMetrics>();
+                owner.registry.push_back(slot);
+            }
+        }
+        ~ThreadLease() {
+            std::lock_guard<std::mutex> lock(owner.mutex);
+            owner.free_slots.push_back(std::move(slot));
+        }
+        ThreadMetrics& get() { return *slot; }
+    };
+
+    Snapshot snapshot() {
+        Snapshot result;
+        std::vector<std::shared_ptr<ThreadMetrics>> threads;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            threads = registry;
+            for (const auto& worker : remote) result.add(worker.second);
+        }
+        for (const auto& thread : threads) {
+            for (size_t m = 0; m < result.latency.size(); ++m) {
+                thread->latency[m].addTo(result.latency[m], result.latency_sum[m]);
+                thread->wait[m].addTo(result.wait[m], result.wait_sum[m]);
+            }
+            result.images += thread->images.load(std::memory_order_relaxed);
+            result.bytes_in += thread->bytes_in.load(std::memory_order_relaxed);
+            result.bytes_out += thread->bytes_out.load(std::memory_order_relaxed);
+            result.dropped += thread->dropped.load(std::memory_order_relaxed);
+        }
+        return result;
+    }
+
+    static uint64_t total(const std::vector<uint64_t>& counts) {
+        uint64_t sum = 0;
+        for (uint64_t count : counts) sum += count;
+        return sum;
+    }
+
+    // Квантиль в миллисекундах
+    static double quantile(const std::vector<uint64_t>& counts, double q) {
+        uint64_t n = total(counts);
+        if (n == 0) return 0.0;
+        uint64_t rank = static_cast<uint64_t>(std::ceil(q * n)), seen = 0;
+        for (size_t b = 0; b < counts.size(); ++b) {
+            seen += counts[b];
+            if (seen >= std::max<uint64_t>(rank, 1)) return LatencyHistogram::bucketValue(b) / 1e6;
+        }
+        return 0.0;
+    }
+
+    std::vector<std::pair<std::string, size_t>> queueDepths() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<std::pair<std::string, size_t>> depths;
+        for (auto& queue : queues) depths.emplace_back(queue.first, queue.second());
+        return depths;
+    }
+
+    void report(bool final) {
+        std::lock_guard<std::mutex> lock(report_mutex);
+        auto now = std::chrono::steady_clock::now();
+        Snapshot current = snapshot();
+        // Периодическая сводка — за интервал, итоговая — с начала запуска
+        Snapshot span = final ? current : current.minus(previous);
+        double seconds = std::chrono::duration<double>(now - (final ? started : previous_time)).count();
+        seconds = std::max(seconds, 1e-9);
+        auto depths = queueDepths();
+
+        std::ostringstream line;
+        line.setf(std::ios::fixed);
+        line.precision(1);
+        line << "[Metrics] " << (final ? "total " : "") << span.images / seconds << " img/s, in "
+             << span.bytes_in / seconds / 1e6 << " MB/s, out " << span.bytes_out / seconds / 1e6 << " MB/s";
+        if (span.dropped) line << ", " << span.dropped << " failed";
+        line.precision(2);
+        for (size_t m = 0; m < span.latency.size(); ++m) {
+            if (total(span.latency[m]) == 0) continue;
+            line << " | " << metricName(static_cast<Metric>(m)) << " p50 " << quantile(span.latency[m], 0.5)
+                 << " p99 " << quantile(span.latency[m], 0.99) << " ms";
+            if (total(span.wait[m]) != 0) line << " (wait p99 " << quantile(span.wait[m], 0.99) << ")";
+        }
+        if (!depths.empty()) {
+            line << " | queues";
+            for (auto& depth : depths) line << " " << depth.first << "=" << depth.second;
+        }
+        logLine(LogLevel::Info) << line.str();
+
+        previous = current;
+        previous_time = now;
+        if (!dump.empty()) writeDump(current, std::chrono::duration<double>(now - started).count(), depths);
+    }
+
+    // Дамп накопленных с начала запуска значений, файл заменяется атомарно
+    void writeDump(const Snapshot& totals, double elapsed, const std::vector<std::pair<std::string, size_t>>& depths) {
+        bool json = fs::path(dump).extension() == ".json";
+        std::ostringstream out;
+        if (json) {
+            out << "{\"elapsed_s\":" << elapsed << ",\"images\":" << totals.images << ",\"failed\":" << totals.dropped
+                << ",\"bytes_in\":" << totals.bytes_in << ",\"bytes_out\":" << totals.bytes_out << ",\"stages\":{";
+            bool first = true;
+            for (size_t m = 0; m < totals.latency.size(); ++m) {
+                out << (first ? "" : ",") << "\"" << metricName(static_cast<Metric>(m)) << "\":{\"count\":"
+                    << total(totals.latency[m]) << ",\"sum_ms\":" << totals.latency_sum[m] / 1e6
+                    << ",\"p50_ms\":" << quantile(totals.latency[m], 0.5) << ",\"p99_ms\":" << quantile(totals.latency[m], 0.99)
+                    << ",\"wait_p50_ms\":" << quantile(totals.wait[m], 0.5) << ",\"wait_p99_ms\":" << quantile(totals.wait[m], 0.99) << "}";
+                first = false;
+            }
+            out << "},\"queues\":{";
+            first = true;
+            for (auto& depth : depths) {
+                out << (first ? "" : ",") << "\"" << depth.first << "\":" << depth.second;
+                first = false;
+            }
+            out << "}}\n";
+        } else {
+            out << "# TYPE laba3_images_total counter\nlaba3_images_total " << totals.images << "\n"
+                << "# TYPE laba3_failed_total counter\nlaba3_failed_total " << totals.dropped << "\n"
+                << "# TYPE laba3_bytes_total counter\n"
+                << "laba3_bytes_total{direction=\"in\"} " << totals.bytes_in << "\n"
+                << "laba3_bytes_total{direction=\"out\"} " << totals.bytes_out << "\n";
+            const char* kinds[] = { "laba3_stage_latency_seconds", "laba3_queue_wait_seconds" };
+            for (int kind = 0; kind < 2; ++kind) {
+                out << "# TYPE " << kinds[kind] << " summary\n";
+                for (size_t m = 0; m < totals.latency.size(); ++m) {
+                    const auto& counts = kind == 0 ? totals.latency[m] : totals.wait[m];
+                    uint64_t sum = kind == 0 ? totals.latency_sum[m] : totals.wait_sum[m];
+                    std::string stage = metricName(static_cast<Metric>(m));
+                    for (double q : { 0.5, 0.9, 0.99 }) {
+                        out << kinds[kind] << "{stage=\"" << stage << "\",quantile=\"" << q << "\"} " << quantile(counts, q) / 1e3 << "\n";
+                    }
+                    out << kinds[kind] << "_sum{stage=\"" << stage << "\"} " << sum / 1e9 << "\n"
+                        << kinds[kind] << "_count{stage=\"" << stage << "\"} " << total(counts) << "\n";
+                }
+            }
+            out << "# TYPE laba3_queue_depth gauge\n";
+            for (auto& depth : depths) out << "laba3_queue_depth{queue=\"" << depth.first << "\"} " << depth.second << "\n";
+        }
+        std::string temp = dump + ".tmp";
+        FILE* file = std::fopen(temp.c_str(), "w");
+        if (!file) return;
+        std::string text = out.str();
+        bool ok = std::fwrite(text.data(), 1, text.size(), file) == text.size();
+        ok = std::fclose(file) == 0 && ok;
+        if (ok) std::rename(temp.c_str(), dump.c_str());
+    }
+};
+
+Metrics metrics;
+
+uint64_t elapsedNs(std::chrono::steady_clock::time_point since) {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - since).count());
+}
+
+// Стадия конвейера: потоки забирают задания из входной очереди, обрабатывают их
+// и передают в выходную. Если process вернул false, задание отбрасывается.
+// Когда входная очередь закрыта и разобрана, последний поток закрывает выходную
+class Stage {
+private:
+    std::string name;
+    JobQueue& in;
+    JobQueue* out; // nullptr у последней стадии
+    std::function<bool(Job&)> process;
+    size_t batch_size = CONSUMER_BATCH;
+    std::function<void(std::vector<Job>&)> prepare; // Вызывается для каждой забранной порции
+    ThreadPool* pool = nullptr; // Если задан, задания выполняются на пуле
+    struct Worker {
+        std::thread thread;
+        bool exited = false; // Под threads_mutex: поток вышел из цикла, его можно присоединить
+    };
+    std::list<Worker> threads; // list: адрес Worker не меняется, пока поток работает
+    std::mutex threads_mutex; // threads может пополнять AutoTuner
+    std::atomic<size_t> running{0};
+    std::atomic<size_t> retire{0}; // Сколько потоков должно завершиться (уменьшение AutoTuner)
+    std::atomic<uint64_t> busy_ns{0}; // Суммарное время обработки — для оценки загрузки
+    Metric metric = Metric::Count; // Metric::Count — стадия без метрик
+
+    static Metric metricFor(const std::string& name) {
+        for (size_t m = 0; m < static_cast<size_t>(Metric::Count); ++m) {
+            if (name == metricName(static_cast<Metric>(m))) return static_cast<Metric>(m);
+        }
+        return Metric::Count;
+    }
+
+    // extra_ns — доля времени подготовки порции, приходящаяся на задание
+    void forward(Job& job, uint64_t extra_ns = 0) {
+        auto begin = std::chrono::steady_clock::now();
+        bool ok = process(job);
+        uint64_t ns = elapsedNs(begin) + extra_ns;
+        busy_ns.fetch_add(ns, std::memory_order_relaxed);
+        if (metric != Metric::Count) {
+            metrics.record(metric, ns);
+            if (!ok) metrics.count(&Metrics::ThreadMetrics::dropped);
+        }
+        if (!ok) job.releaseResources();
+        else if (out) out->push(std::move(job));
+    }
+
+    bool take(std::vector<Job>& jobs, size_t limit) {
+        auto begin = std::chrono::steady_clock::now();
+        bool ok = in.pop_bulk(jobs, limit);
+        if (ok && metric != Metric::Count) metrics.recordWait(metric, elapsedNs(begin));
+        return ok;
+    }
+
+    void finish() {
+        if (running.fetch_sub(1, std::memory_order_acq_rel) == 1 && out) out->close();
+    }
+
+    // Поток забирает один запрос на завершение, если он есть
+    bool retiring() {
+        size_t requested = retire.load(std::memory_order_relaxed);
+        while (requested != 0) {
+            if (retire.compare_exchange_weak(requested, requested - 1, std::memory_order_relaxed)) return true;
+        }
+        return false;
+    }
+
+    void workerLoop(Worker* self) {
+        std::vector<Job> jobs;
+        jobs.reserve(batch_size);
+        while (!retiring() && take(jobs, batch_size)) {
+            uint64_t prepare_ns = 0;
+            if (prepare) {
+                auto begin = std::chrono::steady_clock::now();
+                prepare(jobs);
+                prepare_ns = elapsedNs(begin) / jobs.size();
+            }
+            for (auto& job : jobs) {
+                forward(job, prepare_ns);
+            }
+        }
+        finish();
+        std::lock_guard<std::mutex> lock(threads_mutex);
+        self->exited = true;
+    }
+
+    // Вызывается под threads_mutex
+    void spawnWorker() {
+        Worker& worker = threads.emplace_back();
+        worker.thread = std::thread(&Stage::workerLoop, this, &worker);
+    }
+
+    // Присоединяет потоки, снятые shrink() и уже завершившиеся: иначе при частых
+    // grow()/shrink() они копились бы до join()
+    void reap() {
+        std::list<Worker> finished;
+        {
+            std::lock_guard<std::mutex> lock(threads_mutex);
+            for (auto it = threads.begin(); it != threads.end();) {
+                auto next = std::next(it);
+                if (it->exited) finished.splice(finished.end(), threads, it);
+                it = next;
+            }
+        }
+        for (auto& worker : finished) worker.thread.join();
+    }
+
+    // Один поток раздаёт задания пулу, выходная очередь закрывается после их завершения
+    void dispatchLoop() {
+        std::vector<Job> jobs;
+        jobs.reserve(CONSUMER_BATCH);
+        while (take(jobs, CONSUMER_BATCH)) {
+            for (auto& job : jobs) {
+                auto shared = std::make_shared<Job>(std::move(job));
+                pool->submit([this, shared]() { forward(*shared); });
+            }
+        }
+        pool->waitIdle();
+        finish();
+    }
+
+public:
+    Stage(std::string name, JobQueue& in, JobQueue* out, size_t workers, std::function<bool(Job&)> process,
+          size_t batch_size = CONSUMER_BATCH, std::function<void(std::vector<Job>&)> prepare = nullptr)
+        : name(std::move(name)), in(in), out(out), process(std::move(process)),
+          batch_size(std::max<size_t>(1, batch_size)), prepare(std::move(prepare)), metric(metricFor(this->name)) {
+        workers = std::max<size_t>(1, workers);
+        running.store(workers);
+        std::lock_guard<std::mutex> lock(threads_mutex);
+        for (size_t i = 0; i < workers; ++i) spawnWorker();
+    }
+
+    Stage(std::string name, JobQueue& in, JobQueue* out, ThreadPool& pool, std::function<bool(Job&)> process)
+        : name(std::move(name)), in(in), out(out), process(std::move(process)), pool(&pool), metric(metricFor(this->name)) {
+        running.store(1);
+        threads.emplace_back().thread = std::thread(&Stage::dispatchLoop, this);
+    }
+
+    ~Stage() { join(); }
+
+    // Дожидается всех потоков, включая добавленные grow() во время ожидания
+    void join() {
+        while (true) {
+            std::list<Worker> joining;
+            {
+                std::lock_guard<std::mutex> lock(threads_mutex);
+                joining.swap(threads);
+            }
+            if (joining.empty()) return;
+            for (auto& worker : joining) {
+                if (worker.thread.joinable()) worker.thread.join();
+            }
+        }
+    }
+
+    const std::string& getName() const { return name; }
+
+    // Для AutoTuner: только стадии на собственных потоках меняют их число
+    bool resizable() const { return pool == nullptr; }
+    size_t workers() const {
+        size_t active = running.load(std::memory_order_relaxed), leaving = retire.load(std::memory_order_relaxed);
+        return active > leaving ? active - leaving : 0;
+    }
+    uint64_t busyNs() const { return busy_ns.load(std::memory_order_relaxed); }
+    size_t inputDepth() { return in.size(); }
+    size_t outputDepth() { return out ? out->size() : 0; }
+
+    // Ещё один поток; false, если стадия уже завершилась
+    bool grow() {
+        reap();
+        std::lock_guard<std::mutex> lock(threads_mutex);
+        size_t current = running.load(std::memory_order_relaxed);
+        do {
+            if (current == 0) return false; // Выходная очередь уже закрыта
+        } while (!running.compare_exchange_weak(current, current + 1, std::memory_order_acq_rel));
+        spawnWorker();
+        return true;
+    }
+
+    // Один поток завершится после текущей порции; последний поток не снимается
+    bool shrink() {
+        if (workers() <= 1) return false;
+        retire.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+};
+
+// Шаг цепочки преобразований. Поточечные операции (значение канала → новое значение)
+// не применяются по отдельности: цепочка сливает их в одну таблицу
+class Transform {
+public:
+    virtual ~Transform() = default;
+    virtual std::string prefix() const = 0; // Часть префикса имени выходного файла
+    virtual bool isPointOp() const { return false; }
+    // Результат почти не зависит от того, выполнена операция до уменьшения кадра или после
+    // (поточечные операции и перевод в оттенки серого) — см. TransformChain::leadingResize
+    virtual bool commutesWithResize() const { return isPointOp(); }
+    // Для поточечных операций: новое значение канала, max_value — максимум для глубины
+    virtual double map(double value, double max_value) const { (void)max_value; return value; }
+    // Для остальных операций: преобразование всего кадра
+    virtual void apply(cv::Mat& image) const { (void)image; }
+    // То же на устройстве OpenCL; false — операция есть только на CPU
+    virtual bool applyDevice(cv::UMat& image) const { (void)image; return false; }
+};
+
+class InvertTransform : public Transform {
+public:
+    std::string prefix() const override { return "inverted"; }
+    bool isPointOp() const override { return true; }
+    double map(double value, double max_value) const override { return max_value - value; }
+};
+
+// value * alpha + beta; beta задаётся в шкале 8 бит
+class BrightnessContrastTransform : public Transform {
+private:
+    double alpha, beta;
+
+public:
+    BrightnessContrastTransform(double alpha, double beta) : alpha(alpha), beta(beta) {}
+    std::string prefix() const override { return "adjusted"; }
+    bool isPointOp() const override { return true; }
+    double map(double value, double max_value) const override {
+        return value * alpha + beta * max_value / 255.0;
+    }
+};
+
+class GrayscaleTransform : public Transform {
+public:
+    std::string prefix() const override { return "gray"; }
+    bool commutesWithResize() const override { return true; }
+    void apply(cv::Mat& image) const override {
+        if (image.channels() == 1) return;
+        cv::Mat gray = pooledMat();
+        cv::cvtColor(image, gray, image.channels() == 4 ? cv::COLOR_BGRA2GRAY : cv::COLOR_BGR2GRAY);
+        image = gray;
+    }
+    bool applyDevice(cv::UMat& image) const override {
+        if (image.channels() == 1) return true;
+        cv::UMat gray;
+        cv::cvtColor(image, gray, image.channels() == 4 ? cv::COLOR_BGRA2GRAY : cv::COLOR_BGR2GRAY);
+        image = gray;
+        return true;
+    }
+};
+
+// Уменьшение (или увеличение) до заданного размера; 0 по одной из сторон — сохранить пропорции
+class ResizeTransform : public Transform {
+private:
+    int width, height;
+
+public:
+    ResizeTransform(int width, int height) : width(width), height(height) {}
+    std::string prefix() const override { return "resized"; }
+    cv::Size targetSize(const cv::Size& source) const {
+        int w = width, h = height;
+        if (w == 0) w = std::max(1, source.width * h / std::max(1, source.height));
+        if (h == 0) h = std::max(1, source.height * w / std::max(1, source.width));
+        return cv::Size(w, h);
+    }
+    void apply(cv::Mat& image) const override {
+        cv::Size size = targetSize(image.size());
+        bool shrinking = size.width < image.cols && size.height < image.rows;
+        cv::Mat resized = pooledMat();
+        cv::resize(image, resized, size, 0, 0, shrinking ? cv::INTER_AREA : cv::INTER_LINEAR);
+        image = resized;
+    }
+    bool applyDevice(cv::UMat& image) const override {
+        cv::Size size = targetSize(image.size());
+        bool shrinking = size.width < image.cols && size.height < image.rows;
+        cv::UMat resized;
+        cv::resize(image, resized, size, 0, 0, shrinking ? cv::INTER_AREA : cv::INTER_LINEAR);
+        image = resized;
+        return true;
+    }
+};
+
+class BlurTransform : public Transform {
+private:
+    int kernel_size;
+
+public:
+    explicit BlurTransform(int kernel_size) : kernel_size(kernel_size | 1) {} // Ядро должно быть нечётным
+    std::string prefix() const override { return "blurred"; }
+    void apply(cv::Mat& image) const override {
+        cv::Mat blurred = pooledMat();
+        cv::GaussianBlur(image, blurred, cv::Size(kernel_size, kernel_size), 0);
+        image = blurred;
+    }
+    bool applyDevice(cv::UMat& image) const override {
+        cv::UMat blurred;
+        cv::GaussianBlur(image, blurred, cv::Size(kernel_size, kernel_size), 0);
+        image = blurred;
+        return true;
+    }
+};
+
+// Применяет fn ко всему изображению или, если оно крупнее tile_threshold,
+// к горизонтальным полосам параллельно на пуле, дожидаясь их всех
+void forEachTile(cv::Mat& image, ThreadPool& pool, const std::function<void(cv::Mat&)>& fn) {
+    size_t pixels = static_cast<size_t>(image.rows) * image.cols;
+    if (pixels < options.tile_threshold || image.rows < 2) {
+        fn(image);
+        return;
+    }
+
+    size_t row_bytes = static_cast<size_t>(image.cols) * image.elemSize();
+    size_t band_rows = options.tile_rows != 0 ? options.tile_rows
+                                              : std::max<size_t>(1, TILE_BYTES / row_bytes);
+    TaskGroup group(pool);
+    for (size_t y = 0; y < static_cast<size_t>(image.rows); y += band_rows) {
+        int end = static_cast<int>(std::min(y + band_rows, static_cast<size_t>(image.rows)));
+        cv::Mat band = image.rowRange(static_cast<int>(y), end); // Полоса ссылается на те же пиксели
+        group.run([band, &fn]() mutable { fn(band); });
+    }
+    group.wait();
+}
+
+// Таблицы слитых поточечных операций для 8- и 16-битных каналов
+struct PointTables {
+    std::array<uchar, 256> lut8;
+    std::vector<ushort> lut16; // 65536 значений
+
+    template <typename T>
+    const T* lut() const {
+        if constexpr (sizeof(T) == 1) {
+            return lut8.data();
+        } else {
+            return lut16.data();
+        }
+    }
+};
+
+// Число цветовых каналов: альфа-канал поточечные операции не трогают
+template <int C>
+constexpr int colorChannels() {
+    return C == 4 ? 3 : C;
+}
+
+// Поточечное ядро, специализированное по типу канала и их числу:
+// цикл по каналам раскрывается компилятором полностью
+template <typename T, int C>
+void pointKernel(cv::Mat& tile, const PointTables& tables) {
+    const T* lut = tables.lut<T>();
+    for (int y = 0; y < tile.rows; ++y) {
+        T* row = tile.ptr<T>(y);
+        for (int x = 0; x < tile.cols; ++x) {
+            T* pixel = row + static_cast<size_t>(x) * C;
+            for (int c = 0; c < colorChannels<C>(); ++c) {
+                pixel[c] = lut[pixel[c]];
+            }
+        }
+    }
+}
+
+// Инверсия: без альфа-канала это просто XOR всех байтов (SIMD-ядро),
+// с альфа-каналом — max - value только для цветовых каналов
+template <typename T, int C>
+void invertKernelFor(cv::Mat& tile, const PointTables&) {
+    if constexpr (C != 4) {
+        invertInPlace(tile);
+    } else {
+        constexpr T max_value = std::numeric_limits<T>::max();
+        for (int y = 0; y < tile.rows; ++y) {
+            T* row = tile.ptr<T>(y);
+            for (int x = 0; x < tile.cols; ++x) {
+                T* pixel = row + static_cast<size_t>(x) * C;
+                for (int c = 0; c < colorChannels<C>(); ++c) {
+                    pixel[c] = static_cast<T>(max_value - pixel[c]);
+                }
+            }
+        }
+    }
+}
+
+using PixelKernel = void (*)(cv::Mat& tile, const PointTables& tables);
+
+// Таблица диспетчеризации по Mat::type() для поддерживаемых форматов
+template <template <typename, int> class Kernel>
+std::unordered_map<int, PixelKernel> makeKernelTable() {
+    return {
+        {CV_8UC1, Kernel<uchar, 1>::run},  {CV_8UC3, Kernel<uchar, 3>::run},  {CV_8UC4, Kernel<uchar, 4>::run},
+        {CV_16UC1, Kernel<ushort, 1>::run}, {CV_16UC3, Kernel<ushort, 3>::run}, {CV_16UC4, Kernel<ushort, 4>::run},
+    };
+}
+
+template <typename T, int C>
+struct PointKernel {
+    static void run(cv::Mat& tile, const PointTables& tables) { pointKernel<T, C>(tile, tables); }
+};
+
+template <typename T, int C>
+struct InvertKernelFor {
+    static void run(cv::Mat& tile, const PointTables& tables) { invertKernelFor<T, C>(tile, tables); }
+};
+
+// Цепочка преобразований, заданная через --ops, например "gray,resize=320x0,bc=1.2:10,invert".
+// compile() один раз превращает её в последовательность шагов: подряд идущие поточечные
+// операции сливаются в одну таблицу, чистая инверсия выполняется SIMD-ядром
+class TransformChain {
+private:
+    using Step = std::function<void(cv::Mat&, ThreadPool&)>;
+    using DeviceStep = std::function<bool(cv::UMat&)>; // false — шаг не выполним на устройстве
+
+    std::vector<std::unique_ptr<Transform>> transforms;
+    std::vector<Step> steps;
+    std::vector<DeviceStep> device_steps; // Те же шаги для OpenCL (см. OpenClBackend)
+
+    // Результат поточечных операций [first, last) для одного значения канала
+    long fusePointOps(size_t first, size_t last, double value, double max_value) const {
+        for (size_t i = first; i < last; ++i) {
+            value = std::min(max_value, std::max(0.0, transforms[i]->map(value, max_value)));
+        }
+        return std::lround(value);
+    }
+
+    // Сливает поточечные операции [first, last) в один шаг: таблицы для 8 и 16 бит
+    // строятся один раз, ядро выбирается по типу кадра
+    Step compilePointOps(size_t first, size_t last) const {
+        static const auto point_kernels = makeKernelTable<PointKernel>();
+        static const auto invert_kernels = makeKernelTable<InvertKernelFor>();
+
+        bool invert_only = last - first == 1 && dynamic_cast<const InvertTransform*>(transforms[first].get());
+        const auto& kernels = invert_only ? invert_kernels : point_kernels;
+
+        auto tables = std::make_shared<PointTables>();
+        if (!invert_only) {
+            for (int v = 0; v < 256; ++v) {
+                tables->lut8[v] = static_cast<uchar>(fusePointOps(first, last, v, 255.0));
+            }
+            tables->lut16.resize(65536);
+            for (int v = 0; v < 65536; ++v) {
+                tables->lut16[v] = static_cast<ushort>(fusePointOps(first, last, v, 65535.0));
+            }
+        }
+
+        return [&kernels, tables](cv::Mat& image, ThreadPool& pool) {
+            auto kernel = kernels.find(image.type());
+            if (kernel == kernels.end()) {
+                throw std::runtime_error("unsupported pixel format (type " + std::to_string(image.type()) + ")");
+            }
+            PixelKernel fn = kernel->second;
+            forEachTile(image, pool, [fn, &tables](cv::Mat& tile) { fn(tile, *tables); });
+        };
+    }
+
+    // Те же операции на устройстве: cv::LUT с таблицей на каждый канал, альфа-канал не меняется.
+    // cv::LUT умеет только 8-битные кадры, 16-битные остаются CPU
+    DeviceStep compileDevicePointOps(size_t first, size_t last) const {
+        auto luts = std::make_shared<std::array<cv::Mat, 5>>(); // Индекс — число каналов
+        for (int channels : { 1, 3, 4 }) {
+            cv::Mat lut(1, 256, CV_8UC(channels));
+            for (int v = 0; v < 256; ++v) {
+                uchar value = static_cast<uchar>(fusePointOps(first, last, v, 255.0));
+                uchar* entry = lut.ptr<uchar>(0) + v * channels;
+                for (int c = 0; c < channels; ++c) entry[c] = c == 3 ? static_cast<uchar>(v) : value;
+            }
+            (*luts)[channels] = lut;
+        }
+        return [luts](cv::UMat& image) {
+            if (image.depth() != CV_8U || image.channels() > 4 || (*luts)[image.channels()].empty()) return false;
+            cv::UMat mapped;
+            cv::LUT(image, (*luts)[image.channels()], mapped);
+            image = mapped;
+            return true;
+        };
+    }
+
+public:
+    // Разбор описания цепочки, false с сообщением в error при ошибке
+    bool parse(const std::string& spec, std::string& error) {
+        transforms.clear();
+        std::stringstream stream(spec);
+        std::string item;
+        while (std::getline(stream, item, ',')) {
+            std::string op = item.substr(0, item.find('='));
+            std::string arg = item.find('=') == std::string::npos ? "" : item.substr(item.find('=') + 1);
+            if (op == "invert") {
+                transforms.push_back(std::make_unique<InvertTransform>());
+            } else if (op == "gray") {
+                transforms.push_back(std::make_unique<GrayscaleTransform>());
+            } else if (op == "resize") {
+                int width = 0, height = 0;
+                if (std::sscanf(arg.c_str(), "%dx%d", &width, &height) != 2 || width < 0 || height < 0
+                    || (width == 0 && height == 0)) {
+                    error = "resize expects WxH, e.g. resize=320x240 or resize=320x0";
+                    return false;
+                }
+                transforms.push_back(std::make_unique<ResizeTransform>(width, height));
+            } else if (op == "bc") {
+                double alpha = 1.0, beta = 0.0;
+                if (std::sscanf(arg.c_str(), "%lf:%lf", &alpha, &beta) != 2) {
+                    error = "bc expects ALPHA:BETA, e.g. bc=1.2:10";
+                    return false;
+                }
+                transforms.push_back(std::make_unique<BrightnessContrastTransform>(alpha, beta));
+            } else if (op == "blur") {
+                int kernel_size = std::atoi(arg.c_str());
+                if (kernel_size <= 0) {
+                    error = "blur expects a kernel size, e.g. blur=5";
+                    return false;
+                }
+                transforms.push_back(std::make_unique<BlurTransform>(kernel_size));
+            } else {
+                error = "unknown operation: " + op;
+                return false;
+            }
+        }
+        if (transforms.empty()) {
+            error = "empty transform chain";
+            return false;
+        }
+        return true;
+    }
+
+    void compile() {
+        steps.clear();
+        device_steps.clear();
+        for (size_t i = 0; i < transforms.size();) {
+            if (transforms[i]->isPointOp()) {
+                size_t last = i;
+                while (last < transforms.size() && transforms[last]->isPointOp()) ++last;
+                steps.push_back(compilePointOps(i, last));
+                device_steps.push_back(compileDevicePointOps(i, last));
+                i = last;
+            } else {
+                const Transform* transform = transforms[i].get();
+                steps.push_back([transform](cv::Mat& image, ThreadPool&) { transform->apply(image); });
+                device_steps.push_back([transform](cv::UMat& image) { return transform->applyDevice(image); });
+                ++i;
+            }
+        }
+    }
+
+    void run(cv::Mat& image, ThreadPool& pool) const {
+        for (const auto& step : steps) {
+            step(image, pool);
+        }
+    }
+
+    // Вся цепочка на устройстве; false — какой-то шаг не выполним, image тогда в промежуточном состоянии
+    bool runDevice(cv::UMat& image) const {
+        for (const auto& step : device_steps) {
+            if (!step(image)) return false;
+        }
+        return true;
+    }
+
+    // Цепочка из одной инверсии — для JPEG её можно выполнить в DCT-пространстве
+    bool invertOnly() const {
+        return transforms.size() == 1 && dynamic_cast<const InvertTransform*>(transforms[0].get());
+    }
+
+    // Первое уменьшение цепочки, если до него только перестановочные с ним операции:
+    // тогда JPEG можно сразу декодировать в уменьшенном масштабе (см. decodeFlags)
+    const ResizeTransform* leadingResize() const {
+        for (const auto& transform : transforms) {
+            if (auto resize = dynamic_cast<const ResizeTransform*>(transform.get())) return resize;
+            if (!transform->commutesWithResize()) return nullptr;
+        }
+        return nullptr;
+    }
+
+    // Префикс выходного файла, например "inverted_" или "gray_resized_"
+    std::string prefix() const {
+        std::string result;
+        for (const auto& transform : transforms) {
+            result += transform->prefix() + "_";
+        }
+        return result;
+    }
+};
+
+TransformChain transform_chain;
+
+// Преобразования на GPU через прозрачный OpenCL в OpenCV (cv::UMat). Кадр выгружается
+// из буфера с USAGE_ALLOCATE_HOST_MEMORY — закреплённой памяти, которую встроенный GPU читает
+// без копирования. Очередь команд OpenCL у каждого потока своя, поэтому передачи одних кадров
+// идут параллельно с вычислениями над другими. Мелкие кадры, 16-битные точечные операции
+// и ошибки драйвера — обычный CPU-путь для этого кадра
+class OpenClBackend {
+private:
+    bool enabled = false;
+    std::atomic<uint64_t> offloaded{0}, fallbacks{0};
+
+public:
+    // false, если OpenCL в этой сборке OpenCV или на машине недоступен
+    bool enable() {
+        if (!cv::ocl::haveOpenCL()) return false;
+        cv::ocl::setUseOpenCL(true);
+        enabled = cv::ocl::useOpenCL();
+        return enabled;
+    }
+
+    bool active() const { return enabled; }
+
+    std::string deviceName() const { return cv::ocl::Device::getDefault().name(); }
+
+    // Применяет transform_chain на устройстве; false — image не тронут, нужен CPU-путь
+    bool transform(cv::Mat& image, const std::string& name) {
+        if (!enabled || static_cast<size_t>(image.rows) * image.cols < GPU_MIN_PIXELS) return false;
+        try {
+            cv::UMat device(cv::USAGE_ALLOCATE_HOST_MEMORY);
+            image.copyTo(device);
+            if (!transform_chain.runDevice(device)) {
+                fallbacks.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            cv::Mat result = pooledMat();
+            device.copyTo(result); // Ждёт команд этого потока и забирает результат
+            image = result;
+        } catch (const cv::Exception& e) {
+            logLine(LogLevel::Warn) << "[Transform-" << std::this_thread::get_id() << "] OpenCL failed on " << name
+                                    << ", using the CPU: " << e.what();
+            fallbacks.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        offloaded.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    void report() const {
+        logLine(LogLevel::Info) << "[Main] OpenCL: " << offloaded.load() << " frames on the device, "
+                                << fallbacks.load() << " fell back to the CPU";
+    }
+};
+
+OpenClBackend gpu;
+
+// Проверка, является ли файл скрытым
+bool isHiddenFile(const std::string& file_name) {
+    return file_name[0] == '.';
+}
+
+// Доля от числа аппаратных потоков, но не меньше одного
+size_t defaultWorkers(size_t requested, unsigned divisor) {
+    if (requested != 0) return requested;
+    return std::max(1u, std::thread::hardware_concurrency() / divisor);
+}
+
+// Подходит ли имя файла под обрабатываемые форматы изображений
+bool isImageName(const fs::path& path) {
+    std::string ext = path.extension().string();
+    return ext == ".jpeg" || ext == ".jpg" || ext == ".png";
+}
+
+// Шарды архивов, из которых producer читает записи вместо отдельных файлов
+bool isArchiveName(const fs::path& path) {
+    std::string ext = path.extension().string();
+    return ext == ".tar" || ext == ".pack" || ext == ".zip";
+}
+
+// Путь результата: вложенность относительно входа сохраняется, к имени добавляется префикс цепочки
+// Имя записи архива как путь внутри OUTPUT_DIR. Пустые, абсолютные и выходящие наружу
+// через ".." имена отвергаются: иначе запись перезаписала бы чужой файл (zip-slip)
+bool safeRelativePath(const fs::path& name, fs::path& relative) {
+    fs::path normal = name.lexically_normal();
+    if (normal.empty() || normal.has_root_path() || *normal.begin() == "..") return false;
+    relative = std::move(normal);
+    return true;
+}
+
+std::string outputPathFor(const fs::path& relative) {
+    fs::path result = fs::path(OUTPUT_DIR) / relative.parent_path() / (transform_chain.prefix() + relative.filename().string());
+    return result.string();
+}
+
+// XXH64 — быстрый некриптографический хэш содержимого для инкрементального режима
+uint64_t hashBytes(const uchar* data, size_t size, uint64_t seed = 0) {
+    constexpr uint64_t P1 = 11400714785074694791ULL, P2 = 14029467366897019727ULL, P3 = 1609587929392839161ULL;
+    constexpr uint64_t P4 = 9650029242287828579ULL, P5 = 2870177450012600261ULL;
+    auto rotl = [](uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+    auto read64 = [](const uchar* p) { uint64_t v; std::memcpy(&v, p, 8); return v; };
+    auto read32 = [](const uchar* p) { uint32_t v; std::memcpy(&v, p, 4); return static_cast<uint64_t>(v); };
+    auto round = [&](uint64_t acc, uint64_t input) { return rotl(acc + input * P2, 31) * P1; };
+    auto merge = [&](uint64_t acc, uint64_t value) { return (acc ^ round(0, value)) * P1 + P4; };
+
+    const uchar* p = data;
+    const uchar* end = data + size;
+    uint64_t h;
+    if (size >= 32) {
+        uint64_t v1 = seed + P1 + P2, v2 = seed + P2, v3 = seed, v4 = seed - P1;
+        for (; p + 32 <= end; p += 32) {
+            v1 = round(v1, read64(p));
+            v2 = round(v2, read64(p + 8));
+            v3 = round(v3, read64(p + 16));
+            v4 = round(v4, read64(p + 24));
+        }
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = merge(merge(merge(merge(h, v1), v2), v3), v4);
+    } else {
+        h = seed + P5;
+    }
+    h += size;
+    for (; p + 8 <= end; p += 8) h = rotl(h ^ round(0, read64(p)), 27) * P1 + P4;
+    if (p + 4 <= end) {
+        h = rotl(h ^ (read32(p) * P1), 23) * P2 + P3;
+        p += 4;
+    }
+    for (; p < end; ++p) h = rotl(h ^ (*p * P5), 11) * P1;
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+
+int64_t mtimeNs(const struct stat& info) {
+#ifdef __APPLE__
+    return static_cast<int64_t>(info.st_mtimespec.tv_sec) * 1000000000 + info.st_mtimespec.tv_nsec;
+#else
+    return static_cast<int64_t>(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+#endif
+}
+
+// Манифест инкрементального режима (OUTPUT_DIR/.manifest): размер, mtime и, в режиме hash,
+// XXH64 содержимого каждого входа на момент последнего успешного сохранения. Записанный
+// с другой цепочкой преобразований манифест не действует. Прошлое состояние после load()
+// только читается (сканеры проверяют входы параллельно без блокировок), новые записи
+// копятся отдельно и сливаются в save().
+// Чтобы прерванный запуск не начинался заново, каждая запись сразу дописывается и в журнал
+// OUTPUT_DIR/.manifest.journal — в тех же строках, порциями до JOURNAL_BATCH с одним fsync
+// (и не реже раза в JOURNAL_INTERVAL). load() проигрывает журнал поверх манифеста и тут же
+// сворачивает его в манифест; save() в конце запуска журнал опустошает (в режиме --watch —
+// и checkpoint() по ходу работы)
+class Manifest {
+public:
+    struct Entry {
+        uint64_t size = 0;
+        int64_t mtime = 0;
+        uint64_t hash = 0; // 0 — не вычислялся
+    };
+
+    void load(const std::string& file, const std::string& signature_, bool hashing_) {
+        path = file;
+        signature = signature_;
+        hashing = hashing_;
+        enabled = true;
+        readEntries(path, "LBMANIFEST1\t" + signature);
+        size_t replayed = readEntries(journalPath(), "LBJOURNAL1\t" + signature);
+        logLine(LogLevel::Info) << "[Manifest] Loaded " << previous.size() << " entries";
+        std::lock_guard<std::mutex> io(journal_mutex);
+        bool compacted = true;
+        if (replayed != 0) {
+            // Прошлый запуск прервался: сохранённые им результаты больше не пересчитываются
+            logLine(LogLevel::Info) << "[Manifest] Resuming: " << replayed << " completions replayed from the journal";
+            std::lock_guard<std::mutex> lock(mutex);
+            compacted = writeManifest();
+        }
+        openJournal(compacted); // Не удалось свернуть — дописываем в прежний журнал
+    }
+
+    bool active() const { return enabled; }
+    bool hashes() const { return hashing; }
+
+    // Режим --worker: манифест ведёт координатор, здесь для него только вычисляются хэши
+    void hashOnly() { hashing = true; }
+
+    // Вход не менялся с прошлого сохранения и результат на месте. hash() вызывается
+    // только в режиме hash, если размер совпал, а mtime нет (файл скопировали или «потрогали»)
+    bool upToDate(const std::string& key, const Entry& now, const std::string& output_path,
+                  const std::function<uint64_t()>& hash) {
+        auto it = previous.find(key);
+        if (it == previous.end() || it->second.size != now.size) return false;
+        bool same = it->second.mtime == now.mtime;
+        if (!same && hashing && it->second.hash != 0) {
+            uint64_t current = hash();
+            same = current == it->second.hash;
+            if (same) record(key, { now.size, now.mtime, current }); // Следующий раз хватит stat
+        }
+        if (!same || access(output_path.c_str(), F_OK) != 0) return false;
+        skipped.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Вызывается после того, как результат сохранён: запись в журнале означает готовый файл
+    void record(const std::string& key, const Entry& entry) {
+        bool flush = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            updates.emplace_back(key, entry);
+            if (journal_fd >= 0) {
+                journal_buffer += formatEntry(key, entry);
+                ++journal_pending;
+                flush = journal_pending >= JOURNAL_BATCH
+                     || std::chrono::steady_clock::now() - journal_flushed >= JOURNAL_INTERVAL;
+            }
+        }
+        if (flush) flushJournal();
+    }
+
+    // Слияние и атомарная замена файла манифеста; журнал после этого не нужен
+    void save() {
+        if (!enabled) return;
+        std::lock_guard<std::mutex> io(journal_mutex);
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t recorded = recorded_total + updates.size();
+        if (!compact()) return; // Журнал остаётся — следующий запуск его проиграет
+        logLine(LogLevel::Info) << "[Manifest] Skipped " << skipped.load() << " up-to-date inputs, recorded "
+                  << recorded << " updates";
+    }
+
+    // Режим --watch: процесс не завершается, поэтому updates и журнал сворачиваются в
+    // манифест по ходу работы — когда записей набралось достаточно (не меньше доли от
+    // размера манифеста, чтобы перезапись окупалась) или прошло CHECKPOINT_INTERVAL
+    void checkpoint() {
+        if (!enabled) return;
+        std::lock_guard<std::mutex> io(journal_mutex);
+        std::lock_guard<std::mutex> lock(mutex);
+        if (updates.empty()) return;
+        bool many = updates.size() >= CHECKPOINT_RECORDS && updates.size() >= previous.size() / 8;
+        if (!many && std::chrono::steady_clock::now() - compacted_at < CHECKPOINT_INTERVAL) return;
+        size_t recorded = updates.size();
+        if (compact()) logLine(LogLevel::Debug) << "[Manifest] Checkpoint: " << recorded << " updates merged";
+    }
+
+    static constexpr auto CHECKPOINT_INTERVAL = std::chrono::minutes(5);
+
+private:
+    static constexpr size_t JOURNAL_BATCH = 256;
+    static constexpr auto JOURNAL_INTERVAL = std::chrono::seconds(1);
+    static constexpr size_t CHECKPOINT_RECORDS = 4096;
+
+    std::string path, signature;
+    bool enabled = false, hashing = false;
+    std::unordered_map<std::string, Entry> previous;
+    std::mutex mutex;
+    std::vector<std::pair<std::string, Entry>> updates;
+    std::atomic<size_t> skipped{0};
+    std::mutex journal_mutex; // Запись в журнал и его замена; берётся раньше mutex
+    int journal_fd = -1;
+    std::string journal_buffer; // Под mutex: строки, ещё не дописанные в журнал
+    size_t journal_pending = 0;
+    std::chrono::steady_clock::time_point journal_flushed;
+    std::chrono::steady_clock::time_point compacted_at = std::chrono::steady_clock::now();
+    size_t recorded_total = 0; // Записи, уже свёрнутые checkpoint() — для итога save()
+
+    std::string journalPath() const { return path + ".journal"; }
+
+    static std::string formatEntry(const std::string& key, const Entry& entry) {
+        char hash[17];
+        std::snprintf(hash, sizeof(hash), "%llx", static_cast<unsigned long long>(entry.hash));
+        return std::to_string(entry.size) + "\t" + std::to_string(entry.mtime) + "\t" + hash + "\t" + key + "\n";
+    }
+
+    // Строки файла с заголовком header — в previous. Обрезанная последняя строка журнала
+    // (запуск прервался посреди записи) без '\n' и отбрасывается
+    size_t readEntries(const std::string& file, const std::string& header_line) {
+        FILE* in = std::fopen(file.c_str(), "r");
+        if (!in) return 0;
+        std::string line;
+        bool header = true;
+        size_t count = 0;
+        char chunk[4096];
+        while (std::fgets(chunk, sizeof(chunk), in)) {
+            line += chunk;
+            if (line.back() != '\n') continue; // Длинная строка пришла не целиком
+            line.pop_back();
+            if (header) {
+                header = false;
+                if (line != header_line) break; // Другая цепочка — всё заново
+            } else {
+                Entry entry;
+                unsigned long long size, hash;
+                long long mtime;
+                int consumed = 0;
+                if (std::sscanf(line.c_str(), "%llu\t%lld\t%llx\t%n", &size, &mtime, &hash, &consumed) == 3 && consumed > 0) {
+                    entry.size = size;
+                    entry.mtime = mtime;
+                    entry.hash = hash;
+                    previous[line.substr(consumed)] = entry;
+                    ++count;
+                }
+            }
+            line.clear();
+        }
+        std::fclose(in);
+        return count;
+    }
+
+    // Сливает updates в previous и атомарно заменяет файл манифеста; под mutex
+    bool writeManifest() {
+        for (auto& update : updates) previous[update.first] = update.second;
+        updates.clear();
+        std::string temp = path + ".tmp";
+        FILE* out = std::fopen(temp.c_str(), "w");
+        if (!out) {
+            logLine(LogLevel::Error) << "[Manifest] Error writing " << temp;
+            return false;
+        }
+        std::fprintf(out, "LBMANIFEST1\t%s\n", signature.c_str());
+        for (const auto& item : previous) {
+            std::fprintf(out, "%llu\t%lld\t%llx\t%s\n", static_cast<unsigned long long>(item.second.size),
+                         static_cast<long long>(item.second.mtime), static_cast<unsigned long long>(item.second.hash),
+                         item.first.c_str());
+        }
+        bool ok = std::fflush(out) == 0 && fsync(fileno(out)) == 0;
+        ok = std::fclose(out) == 0 && ok;
+        if (!ok || std::rename(temp.c_str(), path.c_str()) != 0) {
+            logLine(LogLevel::Error) << "[Manifest] Error writing " << path;
+            return false;
+        }
+        return true;
+    }
+
+    // Манифест с updates заменяется, журнал начинается заново; под journal_mutex и mutex
+    bool compact() {
+        size_t merged = updates.size();
+        if (!writeManifest()) return false;
+        recorded_total += merged;
+        journal_buffer.clear(); // Эти строки уже в манифесте
+        journal_pending = 0;
+        openJournal(true);
+        compacted_at = std::chrono::steady_clock::now();
+        return true;
+    }
+
+    // Открывает журнал для дописывания; truncate — начать его заново; под journal_mutex
+    void openJournal(bool truncate) {
+        if (journal_fd >= 0) close(journal_fd);
+        std::string file = journalPath();
+        journal_fd = open(file.c_str(), O_WRONLY | O_CREAT | O_APPEND | (truncate ? O_TRUNC : 0), 0644);
+        journal_flushed = std::chrono::steady_clock::now();
+        if (journal_fd < 0) {
+            logLine(LogLevel::Error) << "[Manifest] Error opening journal " << file << ", an interrupted run will start over";
+            return;
+        }
+        if (truncate) {
+            std::string header = "LBJOURNAL1\t" + signature + "\n";
+            if (write(journal_fd, header.data(), header.size()) != static_cast<ssize_t>(header.size()) || fsync(journal_fd) != 0) {
+                logLine(LogLevel::Error) << "[Manifest] Error writing journal " << file;
+            }
+        }
+    }
+
+    // Дописывает накопленные строки одним write и сбрасывает журнал на диск
+    void flushJournal() {
+        std::lock_guard<std::mutex> io(journal_mutex);
+        std::string chunk;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            chunk.swap(journal_buffer);
+            journal_pending = 0;
+            journal_flushed = std::chrono::steady_clock::now();
+        }
+        if (chunk.empty() || journal_fd < 0) return;
+        size_t done = 0;
+        while (done < chunk.size()) {
+            ssize_t n = write(journal_fd, chunk.data() + done, chunk.size() - done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            done += static_cast<size_t>(n);
+        }
+        if (done != chunk.size() || fsync(journal_fd) != 0) {
+            logLine(LogLevel::Error) << "[Manifest] Error writing journal " << journalPath();
+        }
+    }
+};
+
+Manifest manifest;
+
+// Кэш результатов по содержимому: ключ — XXH64 входных байтов с затравкой из цепочки
+// преобразований и расширения результата. Для уже сохранённого результата помнится его
+// путь (повтор становится жёсткой ссылкой) и, в пределах бюджета, сами закодированные
+// байты (LRU) — для архивного вывода или если ссылку поставить не удалось
+class ResultCache {
+public:
+    void configure(size_t memory_bytes, const std::string& signature) {
+        enabled = true;
+        budget = memory_bytes;
+        seed = hashBytes(reinterpret_cast<const uchar*>(signature.data()), signature.size());
+    }
+
+    bool active() const { return enabled; }
+
+    uint64_t keyFor(const uchar* data, size_t size, const std::string& output_path) const {
+        std::string ext = fs::path(output_path).extension().string();
+        uint64_t key = hashBytes(data, size, seed ^ hashBytes(reinterpret_cast<const uchar*>(ext.data()), ext.size()));
+        return key != 0 ? key : 1; // 0 зарезервирован под «нет ключа»
+    }
+
+    // Заполняет link_source или encoded при попадании
+    bool lookup(Job& job, bool can_link) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (can_link) {
+            auto it = saved.find(job.cache_key);
+            if (it != saved.end()) {
+                job.link_source = it->second;
+                job.pre_encoded = true;
+                ++hits;
+                return true;
+            }
+        }
+        auto it = lru_index.find(job.cache_key);
+        if (it == lru_index.end()) return false;
+        lru.splice(lru.begin(), lru, it->second); // Свежее — в начало списка
+        const std::vector<uchar>& encoded = it->second->second;
+        job.encoded = byte_pool.acquire(encoded.size());
+        std::memcpy(job.encoded.data(), encoded.data(), encoded.size());
+        job.pre_encoded = true;
+        ++hits;
+        return true;
+    }
+
+    // Вызывается писателем для сохранённого результата, пока encoded ещё не возвращён в пул
+    void store(const Job& job) {
+        std::lock_guard<std::mutex> lock(mutex);
+        saved.emplace(job.cache_key, job.link_source.empty() ? job.output_path : job.link_source);
+        if (job.encoded.empty() || job.encoded.size() > budget || lru_index.count(job.cache_key)) return;
+        lru.emplace_front(job.cache_key, job.encoded);
+        lru_index[job.cache_key] = lru.begin();
+        used += job.encoded.size();
+        while (used > budget) {
+            used -= lru.back().second.size();
+            lru_index.erase(lru.back().first);
+            lru.pop_back();
+        }
+    }
+
+    size_t hitCount() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return hits;
+    }
+
+private:
+    bool enabled = false;
+    uint64_t seed = 0;
+    size_t budget = 0, used = 0, hits = 0;
+    std::mutex mutex;
+    std::unordered_map<uint64_t, std::string> saved; // Ключ → путь первого сохранённого результата
+    std::list<std::pair<uint64_t, std::vector<uchar>>> lru;
+    std::unordered_map<uint64_t, std::list<std::pair<uint64_t, std::vector<uchar>>>::iterator> lru_index;
+};
+
+ResultCache result_cache;
+
+// Хэш файла целиком через отображение (для проверки в режиме hash)
+uint64_t hashFile(int dir_fd, const char* name, size_t size) {
+    int fd = openat(dir_fd, name, O_RDONLY);
+    if (fd < 0) return 0;
+    std::shared_ptr<MappedFile> mapping = size != 0 ? mapFile(fd, size) : nullptr;
+    close(fd);
+    return mapping ? hashBytes(mapping->data(), mapping->size()) : hashBytes(nullptr, 0);
+}
+
+// Порядок подачи заданий: в окне из schedule_window заданий первым уходит самое
+// дорогое по оценке (размер кадра по заголовку или размер входа) — LPT, longest processing time first, чтобы крупные
+// файлы не достались одному потоку в хвосте прогона. Пока окно не заполнено, задания
+// всё равно уходят, если в task_queue мало работы: потребители не ждут конца обхода
+class TaskScheduler {
+private:
+    std::mutex mutex;
+    std::vector<Job> heap; // Куча по Job::cost(), наверху самое дорогое
+
+    static bool cheaper(const Job& a, const Job& b) { return a.cost() < b.cost(); }
+
+    bool enabled() const { return options.schedule == "lpt" && options.schedule_window != 0; }
+
+    void popLargest(std::vector<Job>& ready) {
+        std::pop_heap(heap.begin(), heap.end(), cheaper);
+        ready.push_back(std::move(heap.back()));
+        heap.pop_back();
+    }
+
+public:
+    // Нужна ли оценка стоимости (сканеру придётся сделать stat)
+    bool ordering() const { return enabled(); }
+
+    // Замена task_queue.push_bulk для производителей; jobs очищается
+    void push_bulk(std::vector<Job>& jobs) {
+        if (!enabled()) {
+            task_queue.push_bulk(jobs);
+            return;
+        }
+        std::vector<Job> ready;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto& job : jobs) {
+                heap.push_back(std::move(job));
+                std::push_heap(heap.begin(), heap.end(), cheaper);
+            }
+            jobs.clear();
+            size_t queued = task_queue.size();
+            size_t starving = queued < QUEUE_CAPACITY / 4 ? QUEUE_CAPACITY / 4 - queued : 0;
+            while (!heap.empty() && (heap.size() > options.schedule_window || starving > 0)) {
+                popLargest(ready);
+                if (starving > 0) --starving;
+            }
+        }
+        task_queue.push_bulk(ready);
+    }
+
+    // Конец обхода: оставшиеся задания уходят по убыванию стоимости
+    void flush() {
+        std::vector<Job> ready;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            while (!heap.empty()) popLargest(ready);
+        }
+        task_queue.push_bulk(ready);
+    }
+};
+
+TaskScheduler scheduler;
+
+// Записи архива: visit(имя, смещение данных, длина, размер после распаковки или 0 без сжатия)
+using ArchiveVisitor = std::function<void(const std::string&, size_t, size_t, size_t)>;
+
+uint64_t readLE(const uchar* p, int bytes) {
+    uint64_t value = 0;
+    for (int i = bytes - 1; i >= 0; --i) value = (value << 8) | p[i];
+    return value;
+}
+
+// Числовое поле tar: восьмеричное или (для больших значений) base-256
+uint64_t tarNumber(const uchar* field, size_t width) {
+    if (field[0] & 0x80) {
+        uint64_t value = field[0] & 0x7F;
+        for (size_t i = 1; i < width; ++i) value = (value << 8) | field[i];
+        return value;
+    }
+    uint64_t value = 0;
+    for (size_t i = 0; i < width && field[i]; ++i) {
+        if (field[i] >= '0' && field[i] <= '7') value = value * 8 + (field[i] - '0');
+    }
+    return value;
+}
+
+std::string tarString(const uchar* field, size_t width) {
+    const char* begin = reinterpret_cast<const char*>(field);
+    return std::string(begin, strnlen(begin, width));
+}
+
+// ustar с расширениями pax (path, size) и GNU LongName
+bool listTar(const MappedFile& file, const ArchiveVisitor& visit) {
+    const uchar* data = file.data();
+    size_t size = file.size(), pos = 0;
+    std::string next_name; // Из pax/LongName — относится только к следующему заголовку
+    uint64_t next_size = 0;
+    bool has_next_size = false;
+    while (pos + 512 <= size) {
+        const uchar* header = data + pos;
+        if (std::all_of(header, header + 512, [](uchar c) { return c == 0; })) break; // Конец архива
+        char type = static_cast<char>(header[156]);
+        std::string name = tarString(header, 100);
+        if (std::memcmp(header + 257, "ustar", 5) == 0 && header[345]) {
+            name = tarString(header + 345, 155) + "/" + name;
+        }
+        uint64_t entry_size = tarNumber(header + 124, 12);
+        bool regular = type == '0' || type == '\0';
+        if (regular) {
+            if (!next_name.empty()) name = next_name;
+            if (has_next_size) entry_size = next_size;
+        }
+        size_t data_pos = pos + 512;
+        if (entry_size > size - data_pos) return false; // Архив обрезан (сумма могла бы переполниться)
+        pos = data_pos + (entry_size + 511) / 512 * 512;
+
+        if (type == 'x') {
+            // Записи вида "<длина> ключ=значение\n"
+            size_t p = 0;
+            while (p < entry_size) {
+                size_t space = p;
+                while (space < entry_size && data[data_pos + space] != ' ') ++space;
+                if (space == entry_size) return false; // Нет пробела после длины
+                size_t length = std::strtoul(tarString(data + data_pos + p, space - p).c_str(), nullptr, 10);
+                // В длину входят цифры, пробел и завершающий '\n' — иначе запись повреждена
+                if (length < space - p + 2 || length > entry_size - p) return false;
+                std::string record(reinterpret_cast<const char*>(data + data_pos + space + 1), length - (space - p) - 2);
+                size_t eq = record.find('=');
+                if (eq != std::string::npos) {
+                    if (record.compare(0, eq, "path") == 0) next_name = record.substr(eq + 1);
+                    if (record.compare(0, eq, "size") == 0) {
+                        next_size = std::strtoull(record.c_str() + eq + 1, nullptr, 10);
+                        has_next_size = true;
+                    }
+                }
+                p += length;
+            }
+            continue;
+        }
+        if (type == 'L') {
+            next_name = tarString(data + data_pos, entry_size);
+            continue;
+        }
+        if (regular) visit(name, data_pos, entry_size, 0);
+        next_name.clear();
+        has_next_size = false;
+    }
+    return true;
+}
+
+// Формат ArchiveSink::Format::Pack: индекс в конце файла
+bool listPack(const MappedFile& file, const ArchiveVisitor& visit) {
+    const uchar* data = file.data();
+    size_t size = file.size();
+    if (size < 32 || std::memcmp(data, "LBPACK01", 8) != 0 || std::memcmp(data + size - 8, "LBPACK01", 8) != 0) {
+        return false;
+    }
+    uint64_t index_offset = readLE(data + size - 24, 8);
+    uint64_t count = readLE(data + size - 16, 8);
+    size_t end = size - 24;
+    if (index_offset > end) return false; // Индекс за пределами файла
+    // Границы — вычитанием: суммы из непроверенных полей могли бы переполниться
+    size_t pos = index_offset;
+    for (uint64_t i = 0; i < count; ++i) {
+        if (end - pos < 20) return false;
+        size_t name_length = readLE(data + pos, 4);
+        if (name_length > end - pos - 20) return false;
+        std::string name(reinterpret_cast<const char*>(data + pos + 4), name_length);
+        uint64_t offset = readLE(data + pos + 4 + name_length, 8);
+        uint64_t length = readLE(data + pos + 12 + name_length, 8);
+        if (offset > index_offset || length > index_offset - offset) return false;
+        visit(name, offset, length, 0);
+        pos += 20 + name_length;
+    }
+    return true;
+}
+
+// Zip без ZIP64: записи без сжатия и (при наличии zlib) deflate
+bool listZip(const MappedFile& file, const ArchiveVisitor& visit) {
+    const uchar* data = file.data();
+    size_t size = file.size();
+    if (size < 22) return false;
+    // Запись конца центрального каталога ищем с конца: за ней может быть комментарий до 64 КБ
+    size_t eocd = std::string::npos;
+    for (size_t pos = size - 22 + 1; pos-- > (size > 22 + 65535 ? size - 22 - 65535 : 0);) {
+        if (readLE(data + pos, 4) == 0x06054b50) {
+            eocd = pos;
+            break;
+        }
+    }
+    if (eocd == std::string::npos) return false;
+    uint64_t count = readLE(data + eocd + 10, 2);
+    size_t pos = readLE(data + eocd + 16, 4);
+    if (pos == 0xFFFFFFFF) {
+        logLine(LogLevel::Error) << "[Producer] ZIP64 archives are not supported";
+        return false;
+    }
+    // Границы — вычитанием, как в listTar: поля архива не проверены и суммы могли бы переполниться
+    for (uint64_t i = 0; i < count; ++i) {
+        if (pos > size || size - pos < 46 || readLE(data + pos, 4) != 0x02014b50) return false;
+        unsigned method = readLE(data + pos + 10, 2);
+        size_t compressed = readLE(data + pos + 20, 4);
+        [[maybe_unused]] size_t uncompressed = readLE(data + pos + 24, 4);
+        size_t name_length = readLE(data + pos + 28, 2);
+        size_t extra_length = readLE(data + pos + 30, 2);
+        size_t comment_length = readLE(data + pos + 32, 2);
+        size_t local = readLE(data + pos + 42, 4);
+        if (name_length + extra_length + comment_length > size - pos - 46) return false; // Запись обрезана
+        std::string name(reinterpret_cast<const char*>(data + pos + 46), name_length);
+        pos += 46 + name_length + extra_length + comment_length;
+
+        if (local > size || size - local < 30 || readLE(data + local, 4) != 0x04034b50) return false;
+        size_t local_extra = readLE(data + local + 26, 2) + readLE(data + local + 28, 2);
+        if (local_extra > size - local - 30) return false;
+        size_t data_pos = local + 30 + local_extra;
+        if (compressed > size - data_pos) return false;
+        if (!name.empty() && name.back() == '/') continue; // Каталог
+        if (method == 0) {
+            visit(name, data_pos, compressed, 0);
+#ifdef HAVE_ZLIB
+        } else if (method == 8) {
+            visit(name, data_pos, compressed, uncompressed);
+#endif
+        } else {
+            logLine(LogLevel::Debug) << "[Producer] Skipping zip entry with unsupported compression: " << name;
+        }
+    }
+    return true;
+}
+
+// Для сжатой записи zip — распаковка в буфер из пула на стадии чтения
+bool inflateEntry(Job& job) {
+    if (job.inflated_size == 0) return true;
+#ifdef HAVE_ZLIB
+    std::vector<uchar> output = byte_pool.acquire(job.inflated_size);
+    z_stream stream = {};
+    if (inflateInit2(&stream, -MAX_WBITS) != Z_OK) return false; // Сырой deflate без заголовка
+    stream.next_in = const_cast<uchar*>(job.inputData());
+    stream.avail_in = static_cast<uInt>(job.inputSize());
+    stream.next_out = output.data();
+    stream.avail_out = static_cast<uInt>(output.size());
+    int rc = inflate(&stream, Z_FINISH);
+    bool ok = rc == Z_STREAM_END && stream.total_out == job.inflated_size;
+    inflateEnd(&stream);
+    job.releaseInput(); // Сжатые байты в шарде больше не нужны
+    if (!ok) {
+        byte_pool.release(std::move(output));
+        logLine(LogLevel::Error) << "[Reader-" << std::this_thread::get_id() << "] Error inflating " << job.input_path;
+        return false;
+    }
+    job.bytes = std::move(output);
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Добавляет задачи для записей шарда архива: шард отображается в память один раз,
+// задания ссылаются на свои участки без копирования и без отдельных open()
+void produceArchive(const fs::path& path, std::vector<Job>& batch, const fs::path& output_dir = {}) {
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        if (fd >= 0) close(fd);
+        logLine(LogLevel::Error) << "[Producer] Error opening archive: " << path;
+        return;
+    }
+    std::shared_ptr<MappedFile> mapping = mapFile(fd, static_cast<size_t>(info.st_size));
+    close(fd);
+    int64_t shard_mtime = mtimeNs(info);
+    if (!mapping) {
+        logLine(LogLevel::Error) << "[Producer] Error mapping archive: " << path;
+        return;
+    }
+
+    size_t added = 0;
+    ArchiveVisitor visit = [&](const std::string& name, size_t offset, size_t length, size_t inflated) {
+        fs::path entry;
+        if (!safeRelativePath(name, entry)) {
+            logLine(LogLevel::Error) << "[Producer] Skipping unsafe entry name in " << path << ": " << name;
+            return;
+        }
+        std::string file_name = entry.filename().string();
+        if (file_name.empty() || isHiddenFile(file_name) || !isImageName(entry)) return;
+        Job job;
+        job.name = file_name;
+        job.input_path = path.string() + "!" + name; // Для сообщений и выбора флагов декодирования
+        job.output_path = outputPathFor(output_dir / entry);
+        job.mapping = mapping;
+        job.input_offset = offset;
+        job.input_length = length;
+        job.inflated_size = inflated;
+        job.archived = true;
+        job.source_size = inflated != 0 ? inflated : length;
+        if (manifest.active()) {
+            job.source_size = length;
+            job.source_mtime = shard_mtime; // Записи архива меняются только вместе с шардом
+            if (manifest.upToDate(job.input_path, { job.source_size, job.source_mtime }, job.output_path, [&] {
+                    return inflated != 0 ? 0 : hashBytes(mapping->data() + offset, length);
+                })) {
+                return;
+            }
+        }
+        // Сжатые записи разбираются только после распаковки, в стадии чтения
+        if (options.probe && inflated == 0 && !probeImage(mapping->data() + offset, length, job.probe)) {
+            logLine(LogLevel::Error) << "[Producer] " << probeFailure(job.probe) << job.input_path;
+            return;
+        }
+        batch.push_back(std::move(job));
+        ++added;
+        if (batch.size() >= PRODUCER_BATCH) {
+            scheduler.push_bulk(batch);
+        }
+    };
+
+    std::string ext = path.extension().string();
+    bool ok = ext == ".tar" ? listTar(*mapping, visit) : ext == ".pack" ? listPack(*mapping, visit) : listZip(*mapping, visit);
+    if (!ok) {
+        logLine(LogLevel::Error) << "[Producer] Archive is corrupt or truncated: " << path;
+    }
+    logLine(LogLevel::Info) << "[Producer] Added " << added << " entries from " << path.filename().string();
+}
+
+// Что делать с найденным файлом изображения
+enum class Admission {
+    Queued,   // Задание готово
+    Skipped,  // Не изменился с прошлого запуска (манифест) или исчез
+    Rejected, // Заголовок повреждён или не поддерживается (--probe)
+};
+
+// Задание для файла name в каталоге dir_fd; path — полный путь, relative — относительно
+// корня входа. known — уже известный stat файла, иначе он делается, когда нужен размер
+Admission admitFile(int dir_fd, const char* name, std::string path, const fs::path& relative,
+                    const struct stat* known, Job& job) {
+    job.name = relative.filename().string();
+    job.input_path = std::move(path);
+    job.output_path = outputPathFor(relative);
+    struct stat info;
+    if (known) info = *known;
+    if (manifest.active() || scheduler.ordering() || options.probe) {
+        // stat ради размера и mtime; проверка манифеста идёт здесь же, в потоках сканера
+        if (!known && fstatat(dir_fd, name, &info, 0) != 0) return Admission::Skipped;
+        job.source_size = static_cast<uint64_t>(info.st_size);
+        job.source_mtime = mtimeNs(info);
+    }
+    if (manifest.active() && manifest.upToDate(job.input_path, { job.source_size, job.source_mtime }, job.output_path,
+                                               [&] { return hashFile(dir_fd, name, info.st_size); })) {
+        return Admission::Skipped;
+    }
+    if (options.probe && !probeFile(dir_fd, name, job.source_size, job.probe)) {
+        logLine(LogLevel::Error) << "[Producer] " << probeFailure(job.probe) << job.input_path;
+        return Admission::Rejected;
+    }
+    return Admission::Queued;
+}
+
+// Записи каталога порциями: на Linux getdents64 с большим буфером вместо readdir,
+// тип берётся из d_type (DT_UNKNOWN, если файловая система его не сообщает)
+template <typename Visitor>
+bool listDirectory(int dir_fd, std::vector<char>& buffer, Visitor&& visit) {
+#ifdef __linux__
+    struct LinuxDirent64 {
+        uint64_t d_ino;
+        int64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[1];
+    };
+    for (;;) {
+        long n = syscall(SYS_getdents64, dir_fd, buffer.data(), buffer.size());
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return false;
+        if (n == 0) return true;
+        for (long pos = 0; pos < n;) {
+            auto* entry = reinterpret_cast<LinuxDirent64*>(buffer.data() + pos);
+            visit(entry->d_name, entry->d_type);
+            pos += entry->d_reclen;
+        }
+    }
+#else
+    (void)buffer;
+    DIR* dir = fdopendir(dup(dir_fd));
+    if (!dir) return false;
+    while (struct dirent* entry = readdir(dir)) {
+        visit(entry->d_name, entry->d_type);
+    }
+    closedir(dir);
+    return true;
+#endif
+}
+
+// Параллельный рекурсивный обход входного каталога. Подкаталоги раздаются потокам
+// через общую очередь, найденные файлы сразу уходят порциями в task_queue —
+// потребители начинают работу, пока обход ещё идёт
+class DirectoryScanner {
+public:
+    using Seen = std::unordered_map<std::string, std::pair<uint64_t, int64_t>>; // Путь → размер и mtime
+
+private:
+    struct Directory {
+        std::string path;     // Путь для open()
+        fs::path relative;    // Путь относительно корня входа, повторяется в OUTPUT_DIR
+    };
+
+    std::mutex mutex;
+    std::condition_variable has_work;
+    std::deque<Directory> pending;
+    size_t busy = 0; // Потоки, обходящие каталог: пока они работают, могут появиться новые подкаталоги
+    std::atomic<size_t> files{0}, directories{0}, skipped{0}, rejected{0};
+    Seen* seen = nullptr;    // Под mutex: файлы, изменённые не раньше seen_since (для DirectoryWatcher)
+    int64_t seen_since = 0;
+
+    static constexpr size_t DIRENT_BUFFER = 256 * 1024;
+
+    void scanLoop() {
+        std::vector<Job> batch;
+        batch.reserve(PRODUCER_BATCH);
+        std::vector<char> buffer(DIRENT_BUFFER);
+        std::vector<Directory> found;
+        for (;;) {
+            Directory dir;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                if (pending.empty() && !batch.empty()) {
+                    // Перед ожиданием отдаём накопленное, чтобы задачи не застревали у сканера
+                    lock.unlock();
+                    scheduler.push_bulk(batch);
+                    lock.lock();
+                }
+                has_work.wait(lock, [this] { return !pending.empty() || busy == 0; });
+                if (pending.empty()) break; // Очередь пуста и никто не обходит каталоги — всё
+                dir = std::move(pending.front());
+                pending.pop_front();
+                ++busy;
+            }
+            scanDirectory(dir, batch, buffer, found);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                for (auto& sub : found) pending.push_back(std::move(sub));
+                --busy;
+            }
+            found.clear();
+            has_work.notify_all();
+        }
+        scheduler.push_bulk(batch);
+        has_work.notify_all();
+    }
+
+    void scanDirectory(const Directory& dir, std::vector<Job>& batch, std::vector<char>& buffer,
+                       std::vector<Directory>& found) {
+        auto begin = std::chrono::steady_clock::now();
+        int dir_fd = open(dir.path.c_str(), O_RDONLY | O_DIRECTORY);
+        if (dir_fd < 0) {
+            logLine(LogLevel::Error) << "[Producer] Error opening directory: " << dir.path;
+            return;
+        }
+        directories.fetch_add(1, std::memory_order_relaxed);
+        bool ok = listDirectory(dir_fd, buffer, [&](const char* name, unsigned char type) {
+            if (name[0] == '.') { // Скрытые файлы и каталоги, а также "." и ".."
+                if (std::strcmp(name, ".") != 0 && std::strcmp(name, "..") != 0) {
+                    skipped.fetch_add(1, std::memory_order_relaxed);
+                }
+                return;
+            }
+            // stat только когда тип не известен из записи каталога;
+            // ссылки на файлы разыменовываем, по ссылкам на каталоги не спускаемся
+            struct stat info;
+            bool link = type == DT_LNK;
+            bool have_info = false; // info уже заполнен и описывает сам файл
+            if (type == DT_UNKNOWN) {
+                if (fstatat(dir_fd, name, &info, AT_SYMLINK_NOFOLLOW) != 0) return;
+                link = S_ISLNK(info.st_mode);
+                have_info = !link;
+                type = S_ISDIR(info.st_mode) ? DT_DIR : S_ISREG(info.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+            if (link) {
+                if (fstatat(dir_fd, name, &info, 0) != 0) return;
+                have_info = true;
+                type = S_ISREG(info.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+            std::string path = dir.path + "/" + name;
+            if (type == DT_DIR) {
+                found.push_back({ path, dir.relative / name });
+                return;
+            }
+            if (type != DT_REG) return;
+            fs::path relative = dir.relative / name;
+            if (seen && (isImageName(relative) || isArchiveName(relative))) {
+                if (!have_info && fstatat(dir_fd, name, &info, 0) != 0) return;
+                have_info = true;
+                if (mtimeNs(info) >= seen_since) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    (*seen)[path] = { static_cast<uint64_t>(info.st_size), mtimeNs(info) };
+                }
+            }
+            if (isImageName(relative)) {
+                Job job;
+                switch (admitFile(dir_fd, name, std::move(path), relative, have_info ? &info : nullptr, job)) {
+                case Admission::Queued:
+                    batch.push_back(std::move(job));
+                    files.fetch_add(1, std::memory_order_relaxed);
+                    if (batch.size() >= PRODUCER_BATCH) scheduler.push_bulk(batch);
+                    break;
+                case Admission::Rejected:
+                    rejected.fetch_add(1, std::memory_order_relaxed);
+                    break;
+                case Admission::Skipped:
+                    break;
+                }
+            } else if (isArchiveName(relative)) {
+                produceArchive(path, batch, dir.relative);
+            } else {
+                skipped.fetch_add(1, std::memory_order_relaxed);
+            }
+        });
+        close(dir_fd);
+        metrics.record(Metric::Scan, elapsedNs(begin));
+        if (!ok) logLine(LogLevel::Error) << "[Producer] Error listing directory: " << dir.path;
+    }
+
+public:
+    // Запоминать в into файлы с mtime не раньше since: о них могли прийти и события
+    // наблюдения, начатого до обхода, — DirectoryWatcher не отдаёт их второй раз
+    void remember(Seen& into, int64_t since) {
+        seen = &into;
+        seen_since = since;
+    }
+
+    // Блокирует до конца обхода; вызывающий поток сам становится одним из сканеров
+    void run(const std::string& root, size_t threads) {
+        pending.push_back({ root, fs::path() });
+        std::vector<std::thread> scanners;
+        for (size_t i = 1; i < threads; ++i) scanners.emplace_back(&DirectoryScanner::scanLoop, this);
+        scanLoop();
+        for (auto& scanner : scanners) scanner.join();
+        logLine(LogLevel::Info) << "[Producer] Added " << files.load() << " files from " << directories.load()
+                  << " directories, skipped " << skipped.load() << " entries"
+                  << (options.probe ? ", rejected " + std::to_string(rejected.load()) + " by header" : std::string());
+    }
+};
+
+// Канал остановки режима --watch: обработчик SIGINT/SIGTERM только пишет в него байт
+int watch_stop_pipe[2] = { -1, -1 };
+
+void requestWatchStop(int) {
+    if (watch_stop_pipe[1] < 0) return;
+    char byte = 1;
+    ssize_t written = write(watch_stop_pipe[1], &byte, 1);
+    (void)written;
+}
+
+// Режим --watch: после первого обхода producer не завершается, а ставит в очередь новые
+// и перезаписанные файлы, пока процесс не получит SIGINT/SIGTERM; конвейер, пулы и очереди
+// всё это время те же. На Linux о файлах сообщает inotify (IN_CLOSE_WRITE — писатель закрыл
+// файл, IN_MOVED_TO — файл переименован внутрь), в том числе во вложенных каталогах; без него
+// вход обходится заново раз в watch_interval секунд и сравнивается с прошлым обходом.
+// Файл уходит в работу, когда watch_settle_ms о нём нет событий, а размер и mtime
+// не изменились, — частично записанный файл до декодера не доходит
+class DirectoryWatcher {
+private:
+    struct Pending {
+        fs::path relative;
+        std::chrono::steady_clock::time_point last_event;
+        uint64_t size;
+        int64_t mtime;
+    };
+
+    using FileState = std::pair<uint64_t, int64_t>; // Размер и mtime
+
+    std::unordered_map<std::string, Pending> pending; // Ждут тишины, по полному пути
+    std::unordered_map<std::string, FileState> known; // Для опроса: состояние на прошлом обходе
+    DirectoryScanner::Seen scanned; // Отданы первым обходом, но могли прийти и событием
+    std::vector<Job> batch;
+    std::vector<char> buffer = std::vector<char>(256 * 1024);
+    std::chrono::milliseconds settle{0};
+    size_t queued = 0;
+#ifdef __linux__
+    int inotify_fd = -1;
+    std::unordered_map<int, std::pair<std::string, fs::path>> watches; // Дескриптор → каталог
+#endif
+
+    // Событие о файле: отсчёт тишины начинается заново
+    void touch(const std::string& path, const fs::path& relative) {
+        if (!isImageName(relative) && !isArchiveName(relative)) return;
+        struct stat info;
+        if (stat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode)) return;
+        pending[path] = { relative, std::chrono::steady_clock::now(), static_cast<uint64_t>(info.st_size), mtimeNs(info) };
+    }
+
+    void enqueue(const std::string& path, const fs::path& relative, const struct stat& info) {
+        if (isArchiveName(relative)) {
+            produceArchive(path, batch, relative.parent_path());
+            return;
+        }
+        Job job;
+        if (admitFile(AT_FDCWD, path.c_str(), path, relative, &info, job) != Admission::Queued) return;
+        logLine(LogLevel::Debug) << "[Watcher] Queued " << path;
+        batch.push_back(std::move(job));
+        ++queued;
+    }
+
+    // Отдаёт в работу утихшие файлы; возвращает, когда проверить оставшиеся
+    std::chrono::milliseconds release() {
+        auto now = std::chrono::steady_clock::now();
+        auto next = std::chrono::milliseconds::max();
+        for (auto it = pending.begin(); it != pending.end();) {
+            auto quiet = now - it->second.last_event;
+            if (quiet < settle) {
+                next = std::min(next, std::chrono::duration_cast<std::chrono::milliseconds>(settle - quiet) + std::chrono::milliseconds(1));
+                ++it;
+                continue;
+            }
+            struct stat info;
+            if (stat(it->first.c_str(), &info) != 0) { // Удалён, не дождавшись обработки
+                it = pending.erase(it);
+                continue;
+            }
+            if (static_cast<uint64_t>(info.st_size) != it->second.size || mtimeNs(info) != it->second.mtime) {
+                // Файл меняется без событий (mmap, сетевая ФС) — ждём ещё
+                it->second.last_event = now;
+                it->second.size = static_cast<uint64_t>(info.st_size);
+                it->second.mtime = mtimeNs(info);
+                next = std::min(next, settle + std::chrono::milliseconds(1));
+                ++it;
+                continue;
+            }
+            auto seen = scanned.find(it->first);
+            if (seen != scanned.end()) {
+                bool same = seen->second == FileState{ static_cast<uint64_t>(info.st_size), mtimeNs(info) };
+                scanned.erase(seen);
+                if (same) { // Тот же файл уже отдан первым обходом
+                    it = pending.erase(it);
+                    continue;
+                }
+            }
+            enqueue(it->first, it->second.relative, info);
+            it = pending.erase(it);
+        }
+        // Следующего события может не быть долго — планировщик не должен придерживать задания:
+        // порция упорядочивается по стоимости и уходит целиком (с обратным давлением task_queue)
+        scheduler.push_bulk(batch);
+        scheduler.flush();
+        return next;
+    }
+
+    // Обход дерева для режима опроса; report — новые и изменившиеся файлы в pending
+    void pollTree(const std::string& root, bool report) {
+        std::unordered_map<std::string, FileState> seen;
+        std::vector<std::pair<std::string, fs::path>> stack{ { root, fs::path() } };
+        while (!stack.empty()) {
+            auto dir = std::move(stack.back());
+            stack.pop_back();
+            int dir_fd = open(dir.first.c_str(), O_RDONLY | O_DIRECTORY);
+            if (dir_fd < 0) continue;
+            listDirectory(dir_fd, buffer, [&](const char* name, unsigned char) {
+                if (name[0] == '.') return;
+                struct stat info;
+                if (fstatat(dir_fd, name, &info, 0) != 0) return;
+                std::string path = dir.first + "/" + name;
+                fs::path relative = dir.second / name;
+                if (S_ISDIR(info.st_mode)) {
+                    stack.emplace_back(path, relative);
+                    return;
+                }
+                if (!S_ISREG(info.st_mode) || (!isImageName(relative) && !isArchiveName(relative))) return;
+                FileState state{ static_cast<uint64_t>(info.st_size), mtimeNs(info) };
+                auto before = known.find(path);
+                if (report && (before == known.end() || before->second != state)) {
+                    pending[path] = { relative, std::chrono::steady_clock::now(), state.first, state.second };
+                }
+                seen.emplace(std::move(path), state);
+            });
+            close(dir_fd);
+        }
+        known.swap(seen); // Удалённые файлы забываются
+    }
+
+#ifdef __linux__
+    // Наблюдение за каталогом и всеми вложенными. contents — их файлы тоже в pending:
+    // каталог появился во время работы, и файлы могли попасть в него раньше наблюдения
+    void watchTree(const std::string& root, const fs::path& root_relative, bool contents) {
+        std::vector<std::pair<std::string, fs::path>> stack{ { root, root_relative } };
+        while (!stack.empty()) {
+            auto dir = std::move(stack.back());
+            stack.pop_back();
+            int wd = inotify_add_watch(inotify_fd, dir.first.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR);
+            if (wd < 0) {
+                logLine(LogLevel::Warn) << "[Watcher] Cannot watch " << dir.first << ": " << std::strerror(errno);
+                continue;
+            }
+            watches[wd] = dir;
+            int dir_fd = open(dir.first.c_str(), O_RDONLY | O_DIRECTORY);
+            if (dir_fd < 0) continue;
+            listDirectory(dir_fd, buffer, [&](const char* name, unsigned char type) {
+                if (name[0] == '.') return;
+                if (type == DT_UNKNOWN) {
+                    struct stat info;
+                    if (fstatat(dir_fd, name, &info, AT_SYMLINK_NOFOLLOW) != 0) return;
+                    type = S_ISDIR(info.st_mode) ? DT_DIR : S_ISREG(info.st_mode) ? DT_REG : DT_UNKNOWN;
+                }
+                if (type == DT_DIR) {
+                    stack.emplace_back(dir.first + "/" + name, dir.second / name);
+                } else if (contents && type == DT_REG) {
+                    touch(dir.first + "/" + name, dir.second / name);
+                }
+            });
+            close(dir_fd);
+        }
+    }
+
+    void readEvents(const std::string& root) {
+        alignas(inotify_event) char events[64 * 1024];
+        bool overflow = false;
+        for (;;) {
+            ssize_t n = read(inotify_fd, events, sizeof(events));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break; // EAGAIN — прочитано всё
+            for (char* p = events; p < events + n;) {
+                auto* event = reinterpret_cast<inotify_event*>(p);
+                p += sizeof(inotify_event) + event->len;
+                if (event->mask & IN_Q_OVERFLOW) {
+                    overflow = true;
+                    continue;
+                }
+                if (event->mask & IN_IGNORED) { // Каталог удалён
+                    watches.erase(event->wd);
+                    continue;
+                }
+                auto it = watches.find(event->wd);
+                if (it == watches.end() || event->len == 0 || event->name[0] == '.') continue; // и наши .part
+                std::string path = it->second.first + "/" + event->name;
+                fs::path relative = it->second.second / event->name;
+                if (event->mask & IN_ISDIR) {
+                    if (event->mask & (IN_CREATE | IN_MOVED_TO)) watchTree(path, relative, true);
+                } else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+                    touch(path, relative);
+                }
+            }
+        }
+        if (overflow) {
+            // Очередь событий ядра переполнилась — какие-то файлы могли быть пропущены
+            logLine(LogLevel::Warn) << "[Watcher] inotify queue overflowed, rescanning " << root;
+            watchTree(root, fs::path(), true);
+        }
+    }
+#endif
+
+public:
+    // Первый обход и наблюдение до SIGINT/SIGTERM
+    void run(const std::string& root) {
+        settle = std::chrono::milliseconds(options.watch_settle_ms);
+        auto interval = std::chrono::seconds(std::max<size_t>(1, options.watch_interval));
+        if (pipe(watch_stop_pipe) != 0) {
+            logLine(LogLevel::Error) << "[Watcher] Cannot create stop pipe: " << std::strerror(errno);
+            return;
+        }
+        std::signal(SIGINT, requestWatchStop);
+        std::signal(SIGTERM, requestWatchStop);
+
+        // Файлы, изменённые после этого момента, обход может застать вместе с их событием.
+        // Запас — на грубые отметки времени файловых систем
+        int64_t watch_started = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count() - 2000000000;
+        bool events = false;
+        int event_fd = -1;
+#ifdef __linux__
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        events = inotify_fd >= 0;
+        if (events) {
+            watchTree(root, fs::path(), false); // До обхода: файлы, пришедшие во время него, не потеряются
+            event_fd = inotify_fd;
+        } else {
+            logLine(LogLevel::Warn) << "[Watcher] inotify is not available (" << std::strerror(errno) << "), polling instead";
+        }
+#endif
+        if (!events) pollTree(root, false);
+
+        DirectoryScanner scanner;
+        scanner.remember(scanned, watch_started);
+        scanner.run(root, defaultWorkers(options.scanners, 4));
+        scheduler.flush(); // Первый обход целиком отдаётся конвейеру
+#ifdef __linux__
+        if (events) logLine(LogLevel::Info) << "[Watcher] Watching " << watches.size() << " directories for new files";
+#endif
+        if (!events) logLine(LogLevel::Info) << "[Watcher] Polling " << root << " every " << interval.count() << " s for new files";
+
+        auto next_poll = std::chrono::steady_clock::now() + interval;
+        for (;;) {
+            auto now = std::chrono::steady_clock::now();
+            if (!events && now >= next_poll) {
+                pollTree(root, true);
+                next_poll = now + interval;
+            }
+            auto wait = release();
+            if (!events) {
+                wait = std::min(wait, std::chrono::duration_cast<std::chrono::milliseconds>(next_poll - now) + std::chrono::milliseconds(1));
+            }
+            manifest.checkpoint();
+            if (manifest.active()) {
+                // Просыпаемся и без событий, чтобы свернуть журнал по таймеру
+                wait = std::min<std::chrono::milliseconds>(wait, Manifest::CHECKPOINT_INTERVAL);
+            }
+            int timeout = wait == std::chrono::milliseconds::max() ? -1 : static_cast<int>(std::min<int64_t>(wait.count(), INT_MAX));
+            pollfd fds[2] = { { watch_stop_pipe[0], POLLIN, 0 }, { event_fd, POLLIN, 0 } }; // fd -1 poll пропускает
+            if (poll(fds, 2, timeout) < 0 && errno != EINTR) break;
+            if (fds[0].revents) break;
+#ifdef __linux__
+            if (fds[1].revents & POLLIN) readEvents(root);
+#endif
+        }
+
+        std::signal(SIGINT, SIG_DFL);
+        std::signal(SIGTERM, SIG_DFL);
+        close(watch_stop_pipe[0]);
+        close(watch_stop_pipe[1]);
+        watch_stop_pipe[0] = watch_stop_pipe[1] = -1;
+#ifdef __linux__
+        if (inotify_fd >= 0) close(inotify_fd);
+        inotify_fd = -1;
+        watches.clear();
+#endif
+        logLine(LogLevel::Info) << "[Watcher] Stopping: queued " << queued << " new files, " << pending.size()
+                                << " still being written were left";
+    }
+};
+
+// Добавляет задачи в очередь: файлы изображений из дерева каталогов, записи найденных
+// в нём шардов архивов, либо записи одного шарда, если вход — сам шард.
+// С --watch затем следит за деревом до сигнала остановки (DirectoryWatcher)
+void producer(const std::string& input) {
+    if (fs::is_regular_file(input) && isArchiveName(input)) {
+        std::vector<Job> batch;
+        produceArchive(input, batch);
+        scheduler.push_bulk(batch);
+    } else if (options.watch) {
+        DirectoryWatcher watcher;
+        watcher.run(input);
+    } else {
+        DirectoryScanner scanner;
+        scanner.run(input, defaultWorkers(options.scanners, 4));
+    }
+    scheduler.flush();
+
+    // Сигнал завершения для стадий: закрываем очередь, они выйдут после её опустошения
+    task_queue.close();
+}
+
+// Окно упреждающего чтения: для всей забранной читателем порции файлов
+// сразу запрашиваем подгрузку, пока обрабатывается первый из них
+void prefetchFiles(std::vector<Job>& jobs) {
+    if (jobs.size() < 2) return;
+    for (size_t i = 1; i < jobs.size(); ++i) {
+        if (jobs[i].archived) continue; // Шард уже отображён целиком
+        int fd = open(jobs[i].input_path.c_str(), O_RDONLY);
+        if (fd < 0) continue;
+        struct stat info;
+        if (fstat(fd, &info) == 0) adviseWillNeed(fd, static_cast<size_t>(info.st_size));
+        close(fd);
+    }
+}
+
+// Стадия чтения: крупные файлы отображаются в память, мелкие читаются одним
+// проходом в буфер из пула. Декодер получает байты без дополнительного копирования
+bool readStage(Job& job) {
+    // Проверка на скрытые файлы внутри consumer
+    if (isHiddenFile(job.name)) {
+        logLine(LogLevel::Debug) << "[Reader-" << std::this_thread::get_id() << "] Skipping hidden file: " << job.name;
+        return false;
+    }
+
+    logLine(LogLevel::Debug) << "[Reader-" << std::this_thread::get_id() << "] Processing " << job.name;
+
+    if (job.archived) return inflateEntry(job); // Файл открывать не нужно
+
+    int fd = open(job.input_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        logLine(LogLevel::Error) << "[Reader-" << std::this_thread::get_id() << "] Error opening file: " << job.input_path;
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        logLine(LogLevel::Error) << "[Reader-" << std::this_thread::get_id() << "] Error reading file: " << job.input_path;
+        return false;
+    }
+    size_t size = static_cast<size_t>(info.st_size);
+
+    if (options.use_mmap && size >= MMAP_THRESHOLD) {
+        job.mapping = mapFile(fd, size);
+        if (job.mapping) {
+            close(fd);
+            job.input_offset = 0;
+            job.input_length = size;
+            return true;
+        }
+        // Не получилось отобразить (например, специальная ФС) — читаем обычным образом
+    }
+
+    job.bytes = byte_pool.acquire(size);
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = read(fd, job.bytes.data() + done, size - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += static_cast<size_t>(n);
+    }
+    close(fd);
+    if (done != size) {
+        logLine(LogLevel::Error) << "[Reader-" << std::this_thread::get_id() << "] Error reading file: " << job.input_path;
+        job.releaseInput();
+        return false;
+    }
+    return true;
+}
+
+// Во сколько раз (1, 2, 4, 8) уменьшить JPEG уже при декодировании: libjpeg масштабирует
+// в DCT-пространстве, и последующему resize остаётся дожать кадр из меньшего. Кадр после
+// такого декодирования не должен стать меньше цели — с учётом возможного поворота по EXIF
+int reducedDecodeFactor(const cv::Size& source) {
+    const ResizeTransform* resize = transform_chain.leadingResize();
+    if (!resize) return 1;
+    cv::Size target = resize->targetSize(source);
+    int longest = std::max(target.width, target.height);
+    for (int factor : { 8, 4, 2 }) {
+        if (std::min(source.width, source.height) / factor >= longest) return factor;
+    }
+    return 1;
+}
+
+// Флаги декодирования сохраняют исходный формат: серые изображения остаются одноканальными,
+// 16-битные — 16-битными. Альфа-канал есть только у PNG, а IMREAD_UNCHANGED игнорирует
+// ориентацию из EXIF, поэтому для остальных форматов используется ANYCOLOR | ANYDEPTH
+int decodeFlags(const Job& job) {
+    std::string ext = fs::path(job.input_path).extension().string();
+    if (ext == ".png") return cv::IMREAD_UNCHANGED;
+    if (job.probe.format == ImageProbe::Format::Jpeg) {
+        bool gray = job.probe.channels == 1; // Серый JPEG остаётся одноканальным, как с IMREAD_ANYCOLOR
+        switch (reducedDecodeFactor(job.probe.size)) {
+        case 8: return gray ? cv::IMREAD_REDUCED_GRAYSCALE_8 : cv::IMREAD_REDUCED_COLOR_8;
+        case 4: return gray ? cv::IMREAD_REDUCED_GRAYSCALE_4 : cv::IMREAD_REDUCED_COLOR_4;
+        case 2: return gray ? cv::IMREAD_REDUCED_GRAYSCALE_2 : cv::IMREAD_REDUCED_COLOR_2;
+        default: break;
+        }
+    }
+    return cv::IMREAD_ANYCOLOR | cv::IMREAD_ANYDEPTH;
+}
+
+#ifdef HAVE_JPEG
+struct JpegError {
+    jpeg_error_mgr base;
+    std::jmp_buf jump;
+};
+
+// Ошибки libjpeg по умолчанию завершают процесс — возвращаемся в invertJpegCoefficients
+void jpegErrorExit(j_common_ptr info) {
+    std::longjmp(reinterpret_cast<JpegError*>(info->err)->jump, 1);
+}
+
+// Инверсия цветов JPEG без IDCT, цветового преобразования и повторного квантования.
+// Отсчёт восстанавливается как IDCT(коэффициенты) + 128, поэтому смена знака всех
+// коэффициентов даёт 256 - x. Для Cb/Cr (получаются как 128 + линейная форма от RGB
+// с нулевой суммой весов) это ровно инверсия, для Y нужен ещё сдвиг на -1: DC уменьшается
+// на 8 / q0 (с округлением, при крупном шаге квантования — ошибка в один уровень).
+// Только YCbCr и серые JPEG; результат выделяется malloc (jpeg_mem_dest)
+bool invertJpegCoefficients(const uchar* data, size_t size, unsigned char** out, unsigned long* out_size) {
+    jpeg_decompress_struct src;
+    jpeg_compress_struct dst;
+    JpegError error;
+    src.err = dst.err = jpeg_std_error(&error.base);
+    error.base.error_exit = jpegErrorExit;
+    jpeg_create_decompress(&src);
+    jpeg_create_compress(&dst);
+    if (setjmp(error.jump)) {
+        jpeg_destroy_compress(&dst);
+        jpeg_destroy_decompress(&src);
+        return false;
+    }
+
+    jpeg_mem_src(&src, const_cast<uchar*>(data), static_cast<unsigned long>(size));
+    jpeg_save_markers(&src, JPEG_COM, 0xFFFF); // EXIF, ICC и прочее переносятся в результат
+    for (int marker = 0; marker < 16; ++marker) jpeg_save_markers(&src, JPEG_APP0 + marker, 0xFFFF);
+    jpeg_read_header(&src, TRUE);
+    bool supported = (src.jpeg_color_space == JCS_YCbCr && src.num_components == 3)
+                  || (src.jpeg_color_space == JCS_GRAYSCALE && src.num_components == 1);
+    if (!supported) {
+        jpeg_destroy_compress(&dst);
+        jpeg_destroy_decompress(&src);
+        return false;
+    }
+
+    jvirt_barray_ptr* coefficients = jpeg_read_coefficients(&src);
+    for (int c = 0; c < src.num_components; ++c) {
+        jpeg_component_info* component = &src.comp_info[c];
+        int q0 = component->quant_table->quantval[0];
+        int dc_shift = c == 0 ? (8 + q0 / 2) / q0 : 0;
+        for (JDIMENSION row = 0; row < component->height_in_blocks; ++row) {
+            JBLOCKARRAY blocks = (*src.mem->access_virt_barray)(reinterpret_cast<j_common_ptr>(&src), coefficients[c], row, 1, TRUE);
+            for (JDIMENSION col = 0; col < component->width_in_blocks; ++col) {
+                JCOEF* block = blocks[0][col];
+                for (int k = 0; k < DCTSIZE2; ++k) block[k] = static_cast<JCOEF>(-block[k]);
+                block[0] = static_cast<JCOEF>(block[0] - dc_shift);
+            }
+        }
+    }
+
+    jpeg_mem_dest(&dst, out, out_size);
+    jpeg_copy_critical_parameters(&src, &dst);
+    if (src.progressive_mode) jpeg_simple_progression(&dst);
+    jpeg_write_coefficients(&dst, coefficients);
+    for (jpeg_saved_marker_ptr marker = src.marker_list; marker; marker = marker->next) {
+        // JFIF и Adobe libjpeg пишет сам
+        bool jfif = marker->marker == JPEG_APP0 && marker->data_length >= 5 && std::memcmp(marker->data, "JFIF", 5) == 0;
+        bool adobe = marker->marker == JPEG_APP0 + 14 && marker->data_length >= 5 && std::memcmp(marker->data, "Adobe", 5) == 0;
+        if ((jfif && dst.write_JFIF_header) || (adobe && dst.write_Adobe_marker)) continue;
+        jpeg_write_marker(&dst, marker->marker, marker->data, marker->data_length);
+    }
+    jpeg_finish_compress(&dst);
+    jpeg_finish_decompress(&src);
+    jpeg_destroy_compress(&dst);
+    jpeg_destroy_decompress(&src);
+    return true;
+}
+#endif
+
+// Быстрый путь --jpeg-dct: готовый результат вместо пикселей, false — идти обычным путём
+bool invertJpegDct(Job& job) {
+#ifdef HAVE_JPEG
+    unsigned char* out = nullptr;
+    unsigned long out_size = 0;
+    bool ok = invertJpegCoefficients(job.inputData(), job.inputSize(), &out, &out_size);
+    if (ok) {
+        job.encoded = byte_pool.acquire(out_size);
+        std::memcpy(job.encoded.data(), out, out_size);
+        job.pre_encoded = true;
+    }
+    std::free(out);
+    return ok;
+#else
+    (void)job;
+    return false;
+#endif
+}
+
+// Сколько байт займёт декодированный кадр — по заголовку, без декодирования
+size_t decodedSizeEstimate(const Job& job) {
+    const ImageProbe& probe = job.probe;
+    if (probe.format == ImageProbe::Format::Jpeg) {
+        size_t factor = reducedDecodeFactor(probe.size);
+        return size_t(probe.size.width / factor) * (probe.size.height / factor) * probe.channels;
+    }
+    if (probe.format == ImageProbe::Format::Png) return static_cast<size_t>(probe.decodedBytes());
+    return job.inputSize() * 4; // Заголовок не разобран — грубая оценка по степени сжатия
+}
+
+// Стадия декодирования: байты файла превращаются в пиксели
+bool decodeStage(Job& job) {
+    metrics.count(&Metrics::ThreadMetrics::bytes_in, job.inputSize());
+    if (manifest.hashes() && job.source_hash == 0) {
+        job.source_hash = hashBytes(job.inputData(), job.inputSize()); // Для записи в манифест
+    }
+    if (result_cache.active()) {
+        job.cache_key = result_cache.keyFor(job.inputData(), job.inputSize(), job.output_path);
+        if (result_cache.lookup(job, options.output_format == "files")) {
+            job.releaseInput(); // Декодировать не нужно
+            return true;
+        }
+    }
+    if (memory_budget.limited()) {
+        // Ждём, пока в бюджете найдётся место под кадр; возвращается после кодирования
+        size_t bytes = decodedSizeEstimate(job);
+        memory_budget.acquire(bytes);
+        job.memory = MemoryTicket(bytes);
+    }
+    if (options.jpeg_dct) {
+        std::string ext = fs::path(job.input_path).extension().string();
+        if ((ext == ".jpg" || ext == ".jpeg") && invertJpegDct(job)) {
+            job.releaseInput();
+            job.memory.release(); // Коэффициенты уже освобождены
+            return true;
+        }
+    }
+    // Заголовок Mat поверх входных байтов — imdecode читает их без копирования
+    cv::Mat input(1, static_cast<int>(job.inputSize()), CV_8U, const_cast<uchar*>(job.inputData()));
+    job.image = pooledMat();
+    cv::imdecode(input, decodeFlags(job), &job.image); // Декодируем прямо в буфер из пула
+    job.releaseInput(); // Сжатые данные больше не нужны
+    if (job.image.empty()) { 
+        logLine(LogLevel::Error) << "[Decoder-" << std::this_thread::get_id() << "] Error reading image: " << job.input_path;
+        job.memory.release();
+        return false;
+    }
+    return true;
+}
+
+// Стадия преобразования: применяет скомпилированную цепочку к декодированному буферу
+bool transformStage(Job& job, ThreadPool& pool) {
+    if (job.pre_encoded) return true;
+    try {
+        if (!gpu.transform(job.image, job.name)) transform_chain.run(job.image, pool);
+    } catch (const std::exception& e) {
+        logLine(LogLevel::Error) << "[Transform-" << std::this_thread::get_id() << "] Error processing " << job.name
+                  << ": " << e.what();
+        return false;
+    }
+    return true;
+}
+
+// Стадия кодирования: формат результата определяется расширением выходного файла
+bool encodeStage(Job& job) {
+    if (job.pre_encoded) return true;
+    std::string ext = fs::path(job.output_path).extension().string();
+    if (job.image.depth() != CV_8U && ext != ".png") {
+        // JPEG хранит только 8 бит на канал
+        cv::Mat narrowed = pooledMat();
+        job.image.convertTo(narrowed, CV_MAKETYPE(CV_8U, job.image.channels()), 1.0 / 257.0);
+        job.image = narrowed;
+    }
+    // Кодируем в буфер из пула: imencode сохраняет его ёмкость, если её хватает
+    job.encoded = byte_pool.acquire(job.image.total() * job.image.elemSize() / 4);
+    job.encoded.clear();
+    bool encoded = cv::imencode(ext, job.image, job.encoded);
+    job.image.release();
+    job.memory.release();
+    if (!encoded) {
+        logLine(LogLevel::Error) << "[Encoder-" << std::this_thread::get_id() << "] Error encoding image: " << job.output_path;
+        return false;
+    }
+    return true;
+}
+
+#ifdef HAVE_IO_URING
+// Порция асинхронных операций чтения/записи через io_uring: подготовка стадии
+// отправляет в ядро операции сразу для всей порции заданий, а обработка каждого
+// задания дожидается только своей. Недочитанные/недописанные части отправляются повторно
+class UringBatch {
+private:
+    static constexpr size_t MAX_CHUNK = 1u << 30; // nbytes в SQE — 32 бита
+
+    struct Op {
+        Job* job;
+        int fd;
+        uchar* buffer;
+        size_t size;
+        size_t done;
+        bool write;
+        bool finished;
+        bool failed;
+    };
+
+    io_uring ring;
+    bool ready = false;
+    std::vector<Op> ops;
+
+    void queue(size_t index) {
+        Op& op = ops[index];
+        io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+        if (!sqe) { // Очередь отправки заполнена — сбрасываем её в ядро
+            io_uring_submit(&ring);
+            sqe = io_uring_get_sqe(&ring);
+        }
+        unsigned chunk = static_cast<unsigned>(std::min(op.size - op.done, MAX_CHUNK));
+        if (op.write) {
+            io_uring_prep_write(sqe, op.fd, op.buffer + op.done, chunk, op.done);
+        } else {
+            io_uring_prep_read(sqe, op.fd, op.buffer + op.done, chunk, op.done);
+        }
+        io_uring_sqe_set_data(sqe, reinterpret_cast<void*>(static_cast<uintptr_t>(index)));
+    }
+
+    // Забирает одно завершение
+    void reap() {
+        io_uring_cqe* cqe = nullptr;
+        int rc = io_uring_wait_cqe(&ring, &cqe);
+        if (rc < 0) {
+            if (rc == -EINTR) return;
+            for (auto& op : ops) { // Кольцо сломано — ждать больше нечего
+                if (!op.finished) op.finished = op.failed = true;
+            }
+            return;
+        }
+        size_t index = static_cast<size_t>(reinterpret_cast<uintptr_t>(io_uring_cqe_get_data(cqe)));
+        int res = cqe->res;
+        io_uring_cqe_seen(&ring, cqe);
+
+        Op& op = ops[index];
+        if (res == -EINTR || res == -EAGAIN) {
+            queue(index);
+            io_uring_submit(&ring);
+        } else if (res <= 0) {
+            op.finished = op.failed = true;
+        } else {
+            op.done += static_cast<size_t>(res);
+            if (op.done < op.size) {
+                queue(index);
+                io_uring_submit(&ring);
+            } else {
+                op.finished = true;
+            }
+        }
+    }
+
+public:
+    explicit UringBatch(unsigned depth) {
+        ready = io_uring_queue_init(std::max(8u, depth), &ring, 0) == 0;
+    }
+
+    ~UringBatch() {
+        if (ready) io_uring_queue_exit(&ring);
+    }
+
+    UringBatch(const UringBatch&) = delete;
+    UringBatch& operator=(const UringBatch&) = delete;
+
+    bool available() const { return ready; }
+
+    void begin() { ops.clear(); }
+
+    // Ставит операцию в порцию; fd переходит во владение порции
+    void add(Job& job, int fd, uchar* buffer, size_t size, bool write) {
+        ops.push_back({&job, fd, buffer, size, 0, write, size == 0, false});
+        if (size != 0) queue(ops.size() - 1);
+    }
+
+    void submit() { io_uring_submit(&ring); }
+
+    // Ждёт операцию задания и закрывает её файл: 1 — успех, 0 — ошибка, -1 — задания нет в порции
+    int wait(Job& job) {
+        for (auto& op : ops) {
+            if (op.job != &job) continue;
+            while (!op.finished) reap();
+            close(op.fd);
+            op.job = nullptr;
+            return op.failed ? 0 : 1;
+        }
+        return -1;
+    }
+};
+
+// Кольцо io_uring текущего потока, nullptr если io_uring недоступен (например, запрещён seccomp)
+// — тогда стадия работает через обычные read/write
+UringBatch* threadUring() {
+    thread_local std::unique_ptr<UringBatch> uring;
+    thread_local bool tried = false;
+    if (!tried) {
+        tried = true;
+        uring = std::make_unique<UringBatch>(static_cast<unsigned>(std::max<size_t>(options.readahead, 8) * 2));
+        if (!uring->available()) {
+            logLine(LogLevel::Warn) << "[IO] io_uring unavailable, falling back to synchronous I/O";
+            uring.reset();
+        }
+    }
+    return uring.get();
+}
+#endif
+
+// Подготовка порции читателя: с io_uring чтение всех файлов отправляется в ядро сразу,
+// без него — только подсказка упреждающего чтения
+void submitReads(std::vector<Job>& jobs) {
+#ifdef HAVE_IO_URING
+    UringBatch* uring = options.use_io_uring ? threadUring() : nullptr;
+    if (uring) {
+        uring->begin();
+        for (auto& job : jobs) {
+            if (isHiddenFile(job.name) || job.archived) continue;
+            int fd = open(job.input_path.c_str(), O_RDONLY);
+            if (fd < 0) continue; // Ошибку сообщит обычный путь чтения
+            struct stat info;
+            if (fstat(fd, &info) != 0) {
+                close(fd);
+                continue;
+            }
+            job.bytes = byte_pool.acquire(static_cast<size_t>(info.st_size));
+            uring->add(job, fd, job.bytes.data(), job.bytes.size(), false);
+        }
+        uring->submit();
+        return;
+    }
+#endif
+    prefetchFiles(jobs);
+}
+
+// Чтение с учётом io_uring: ждём завершения своего чтения,
+// задания вне порции читаются синхронным путём
+bool readOrAwait(Job& job) {
+#ifdef HAVE_IO_URING
+    UringBatch* uring = options.use_io_uring ? threadUring() : nullptr;
+    int result = uring ? uring->wait(job) : -1;
+    if (result == 1) {
+        logLine(LogLevel::Debug) << "[Reader-" << std::this_thread::get_id() << "] Processing " << job.name;
+        return true;
+    }
+    if (result == 0) {
+        logLine(LogLevel::Error) << "[Reader-" << std::this_thread::get_id() << "] Error reading file: " << job.input_path;
+        job.releaseInput();
+        return false;
+    }
+#endif
+    return readStage(job);
+}
+
+// Разбор заголовка сразу после чтения: повреждённые и неподдерживаемые файлы отсеиваются
+// до того, как займут декодер и место в memory_budget. Разобранный сканером (--probe) не повторяется
+bool probeStage(Job& job) {
+    if (job.probe.supported || probeImage(job.inputData(), job.inputSize(), job.probe)) return true;
+    // Без --probe отвергается только узнанный, но повреждённый заголовок. Неразобранное
+    // (12-битный или арифметический JPEG, другой формат под расширением .jpg) пробует
+    // декодер — размеры кадра тогда неизвестны
+    bool corrupt = job.probe.format == ImageProbe::Format::Unknown && hasImageSignature(job.inputData(), job.inputSize());
+    if (!options.probe && !corrupt) {
+        job.probe = ImageProbe();
+        return true;
+    }
+    logLine(LogLevel::Error) << "[Reader-" << std::this_thread::get_id() << "] " << probeFailure(job.probe) << job.input_path;
+    job.releaseInput();
+    return false;
+}
+
+// Стадия чтения конвейера
+bool readOrAwaitStage(Job& job) {
+    return readOrAwait(job) && probeStage(job);
+}
+
+// Когда сбрасывать записанные результаты на носитель
+enum class FsyncMode {
+    None,  // Полагаемся на ОС
+    File,  // fsync после каждого файла
+    Batch, // Отложенный fsync: сначала пишется вся порция, затем она сбрасывается целиком
+};
+
+// Выровненный буфер для записи с O_DIRECT: адрес и длина должны быть кратны блоку
+class AlignedBuffer {
+private:
+    uchar* memory = nullptr;
+    size_t length = 0;
+
+public:
+    static constexpr size_t ALIGNMENT = 4096;
+
+    explicit AlignedBuffer(size_t size)
+        : memory(static_cast<uchar*>(::operator new(size, std::align_val_t(ALIGNMENT)))), length(size) {}
+    ~AlignedBuffer() { ::operator delete(memory, std::align_val_t(ALIGNMENT)); }
+    AlignedBuffer(const AlignedBuffer&) = delete;
+    AlignedBuffer& operator=(const AlignedBuffer&) = delete;
+
+    uchar* data() { return memory; }
+    size_t size() const { return length; }
+};
+
+// Куда стадия записи складывает закодированные результаты. Получает порцию целиком,
+// чтобы объединять запись и сброс на диск; для каждого задания выставляет saved
+// (задания, у которых saved уже выставлен — ссылки из кэша результатов, — пропускает)
+class OutputSink {
+public:
+    virtual ~OutputSink() = default;
+    virtual void writeBatch(std::vector<Job>& jobs) = 0;
+    virtual void close() {}
+};
+
+// Один файл на изображение в OUTPUT_DIR. Каждый результат пишется одним системным вызовом
+// из готового буфера; с --direct-io — через выровненный буфер в обход страничного кэша.
+// Запись идёт во временный скрытый файл рядом (.имя.part), под своим именем результат
+// появляется rename'ом только целиком — прерванный запуск не оставляет обрезанных файлов
+class FileSink : public OutputSink {
+private:
+    static constexpr size_t DIRECT_IO_BUFFER = 4u << 20;
+
+    struct Pending {
+        int fd;           // -1, если файл уже закрыт (io_uring)
+        Job* job;
+        std::string temp; // Куда записан результат до переименования
+    };
+
+    FsyncMode fsync_mode;
+    bool direct_io;
+
+    static std::string partPath(const std::string& path) {
+        fs::path target(path);
+        return (target.parent_path() / ("." + target.filename().string() + ".part")).string();
+    }
+
+    static bool writeAll(int fd, const uchar* data, size_t size) {
+        size_t done = 0;
+        while (done < size) {
+            ssize_t n = write(fd, data + done, size - done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            done += static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    // O_DIRECT: данные копируются в выровненный буфер потока и дополняются до
+    // кратного блоку размера, лишний хвост затем отрезается ftruncate
+    static bool writeDirect(int fd, const uchar* data, size_t size) {
+        thread_local AlignedBuffer staging(DIRECT_IO_BUFFER);
+        size_t done = 0;
+        while (done < size) {
+            size_t chunk = std::min(size - done, staging.size());
+            size_t padded = (chunk + AlignedBuffer::ALIGNMENT - 1) / AlignedBuffer::ALIGNMENT * AlignedBuffer::ALIGNMENT;
+            std::memcpy(staging.data(), data + done, chunk);
+            std::memset(staging.data() + chunk, 0, padded - chunk);
+            size_t written = 0;
+            while (written < padded) {
+                ssize_t n = pwrite(fd, staging.data() + written, padded - written, static_cast<off_t>(done + written));
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) return false;
+                written += static_cast<size_t>(n);
+            }
+            done += chunk;
+        }
+        return ftruncate(fd, static_cast<off_t>(size)) == 0;
+    }
+
+    // path — временный файл; прежний результат (возможно, жёсткая ссылка на чужой файл)
+    // не трогается, rename потом лишь заменит запись каталога
+    int openOutput(const std::string& path, bool& direct) const {
+        std::error_code error;
+        fs::create_directories(fs::path(path).parent_path(), error); // Вложенные каталоги результатов
+        int flags = O_WRONLY | O_CREAT | O_TRUNC;
+        direct = false;
+#ifdef O_DIRECT
+        if (direct_io) {
+            int fd = open(path.c_str(), flags | O_DIRECT, 0644);
+            if (fd >= 0) {
+                direct = true;
+                return fd;
+            }
+            // ФС не поддерживает O_DIRECT (например, tmpfs) — пишем обычным образом
+        }
+#endif
+        int fd = open(path.c_str(), flags, 0644);
+#ifdef F_NOCACHE
+        if (fd >= 0 && direct_io) fcntl(fd, F_NOCACHE, 1); // Аналог O_DIRECT в macOS
+#endif
+        return fd;
+    }
+
+    // Файлы порции закрываются только здесь, чтобы fsync в режиме Batch шёл после всех записей;
+    // переименование — после fsync, иначе после сбоя под именем результата мог бы оказаться пустой файл
+    void finishBatch(std::vector<Pending>& pending, bool sync_files, bool sync_dir) {
+        if (sync_files) {
+            for (auto& item : pending) {
+                if (item.fd >= 0 && item.job->saved) fsync(item.fd);
+            }
+        }
+        for (auto& item : pending) {
+            if (item.fd >= 0) ::close(item.fd);
+            if (item.job->saved && std::rename(item.temp.c_str(), item.job->output_path.c_str()) != 0) {
+                item.job->saved = false;
+            }
+            if (!item.job->saved) unlink(item.temp.c_str());
+        }
+        if (sync_dir) {
+            // Записи о новых файлах лежат в их каталогах, а о созданных по пути подкаталогах —
+            // в родительских: сбрасываются все каталоги порции вплоть до OUTPUT_DIR
+            auto normal = [](const fs::path& path) {
+                fs::path result = path.lexically_normal();
+                return result.has_filename() || !result.has_parent_path() ? result : result.parent_path(); // Без '/' в конце
+            };
+            const fs::path root = normal(OUTPUT_DIR);
+            std::vector<fs::path> dirs;
+            for (auto& item : pending) {
+                if (!item.job->saved) continue;
+                for (fs::path dir = normal(fs::path(item.job->output_path).parent_path()); !dir.empty(); dir = dir.parent_path()) {
+                    if (std::find(dirs.begin(), dirs.end(), dir) != dirs.end()) break; // И его родители уже в списке
+                    dirs.push_back(dir);
+                    if (dir == root || dir == dir.parent_path()) break;
+                }
+            }
+            for (const auto& path : dirs) {
+                int dir = open(path.c_str(), O_RDONLY | O_DIRECTORY);
+                if (dir >= 0) {
+                    fsync(dir);
+                    ::close(dir);
+                }
+            }
+        }
+        pending.clear();
+    }
+
+    // Повтор уже сохранённого результата (--dedupe): жёсткая ссылка или копия ставится под
+    // временным именем и переименовывается в finishBatch вместе с записанными результатами
+    void stageLink(Job& job, std::vector<Pending>& pending) {
+        if (job.link_source == job.output_path) { // Тот же файл
+            job.saved = true;
+            return;
+        }
+        std::error_code error;
+        fs::create_directories(fs::path(job.output_path).parent_path(), error);
+        std::string temp = partPath(job.output_path);
+        unlink(temp.c_str());
+        job.saved = link(job.link_source.c_str(), temp.c_str()) == 0;
+        bool copied = false;
+        if (!job.saved) {
+            // Ссылку не поставить (другая ФС, запрет) — копируем уже записанный файл
+            fs::copy_file(job.link_source, temp, fs::copy_options::overwrite_existing, error);
+            job.saved = copied = !error;
+        }
+        // Данные ссылки уже сброшены вместе с исходным результатом, копию сбрасываем как запись
+        int fd = -1;
+        if (copied && fsync_mode != FsyncMode::None) {
+            fd = open(temp.c_str(), O_WRONLY);
+            if (fsync_mode == FsyncMode::File && fd >= 0) fsync(fd);
+        }
+        pending.push_back({ fd, &job, std::move(temp) });
+    }
+
+#ifdef HAVE_IO_URING
+    // Запись всей порции одной отправкой в io_uring
+    void writeBatchUring(UringBatch& uring, std::vector<Job>& jobs) {
+        uring.begin();
+        std::vector<Pending> submitted, linked;
+        for (auto& job : jobs) {
+            if (job.saved) continue;
+            if (!job.link_source.empty()) {
+                stageLink(job, linked);
+                continue;
+            }
+            std::error_code error;
+            fs::create_directories(fs::path(job.output_path).parent_path(), error);
+            std::string temp = partPath(job.output_path);
+            int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) continue;
+            uring.add(job, fd, job.encoded.data(), job.encoded.size(), true);
+            submitted.push_back({ -1, &job, std::move(temp) });
+        }
+        uring.submit();
+        bool sync = fsync_mode != FsyncMode::None;
+        for (auto& item : submitted) {
+            item.job->saved = uring.wait(*item.job) == 1; // wait() закрывает файл
+            // Сброс после io_uring (в обоих режимах — порцией): заново открываем записанные результаты
+            if (sync && item.job->saved) item.fd = open(item.temp.c_str(), O_WRONLY);
+        }
+        for (auto& item : linked) submitted.push_back(std::move(item));
+        finishBatch(submitted, sync, sync);
+    }
+#endif
 
 public:
-    // Метод добавления элемента в очередь
-    void push(const T& value) {
-        {
-            std::lock_guard<std::mutex> lock(mutex); 
-// Блокируем мьютекс на время выполнения этого блока
-            queue.push(value); // Добавляем элемент в очередь
+    FileSink(FsyncMode fsync_mode, bool direct_io) : fsync_mode(fsync_mode), direct_io(direct_io) {}
+
+    void writeBatch(std::vector<Job>& jobs) override {
+#ifdef HAVE_IO_URING
+        UringBatch* uring = options.use_io_uring && !direct_io ? threadUring() : nullptr;
+        if (uring) {
+            writeBatchUring(*uring, jobs);
+            return;
         }
-        cond_var.notify_one();
- // Уведомляем один из ожидающих потоков о наличии нового элемента
+#endif
+        std::vector<Pending> pending;
+        for (auto& job : jobs) {
+            if (job.saved) continue;
+            if (!job.link_source.empty()) {
+                stageLink(job, pending);
+                continue;
+            }
+            bool direct = false;
+            std::string temp = partPath(job.output_path);
+            int fd = openOutput(temp, direct);
+            if (fd < 0) continue;
+            job.saved = direct ? writeDirect(fd, job.encoded.data(), job.encoded.size())
+                               : writeAll(fd, job.encoded.data(), job.encoded.size());
+            if (fsync_mode == FsyncMode::File && job.saved) fsync(fd);
+            pending.push_back({ fd, &job, std::move(temp) });
+        }
+        finishBatch(pending, fsync_mode == FsyncMode::Batch, fsync_mode != FsyncMode::None);
     }
+};
 
-    // Извлечения элемента из очереди
-    bool pop(T& value) {
-        std::unique_lock<std::mutex> lock(mutex); 
-// Блокируем мьютекс
-        cond_var.wait(lock, [this]() { return !queue.empty(); }); // Ожидаем, пока очередь не станет непустой
+// Вывод в архивные контейнеры вместо миллионов отдельных файлов: результаты
+// последовательно дописываются в шарды OUTPUT_DIR/shard-NNNNN.{tar,pack}.
+// Все писатели разделяют один поток, порция уходит в шард одним writev.
+// У tar-шарда рядом лежит индекс shard-NNNNN.tar.idx (имя, смещение, размер),
+// у pack-шарда индекс записан в конце самого файла:
+//   "LBPACK01" | данные записей | индекс | смещение индекса (u64) | число записей (u64) | "LBPACK01",
+//   запись индекса: длина имени (u32), имя, смещение данных (u64), размер (u64), всё little-endian
+class ArchiveSink : public OutputSink {
+public:
+    enum class Format { Tar, Pack };
+
+private:
+    static constexpr char PACK_MAGIC[9] = "LBPACK01";
+    static constexpr size_t TAR_BLOCK = 512;
+
+    struct IndexEntry {
+        std::string name;
+        uint64_t offset, size;
+    };
+
+    std::mutex mutex;
+    Format format;
+    uint64_t shard_limit;
+    FsyncMode fsync_mode;
+    int fd = -1;
+    unsigned shard_number = 0;
+    uint64_t position = 0;
+    std::string shard_path;
+    std::vector<IndexEntry> index;
+
+    static void putLE(std::string& out, uint64_t value, int bytes) {
+        for (int i = 0; i < bytes; ++i) {
+            out.push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+        }
+    }
+
+    static void putOctal(char* field, size_t width, uint64_t value) {
+        std::snprintf(field, width, "%0*llo", static_cast<int>(width - 1), static_cast<unsigned long long>(value));
+    }
+
+    // Заголовок ustar; длинные имена и большие размеры уходят в pax-запись перед ним
+    static std::string tarHeaders(const std::string& name, uint64_t size) {
+        std::string result;
+        const uint64_t max_octal_size = 077777777777ull;
+        if (name.size() > 100 || size > max_octal_size) {
+            std::string records;
+            auto addRecord = [&records](const std::string& key, const std::string& value) {
+                std::string body = " " + key + "=" + value + "\n";
+                size_t length = body.size() + 1;
+                while (std::to_string(length).size() + body.size() != length) ++length;
+                records += std::to_string(length) + body;
+            };
+            if (name.size() > 100) addRecord("path", name);
+            if (size > max_octal_size) addRecord("size", std::to_string(size));
+            result += tarBlock("PaxHeader", records.size(), 'x');
+            result += records;
+            result.append((TAR_BLOCK - records.size() % TAR_BLOCK) % TAR_BLOCK, '\0');
+        }
+        result += tarBlock(name.substr(0, 100), std::min(size, max_octal_size), '0');
+        return result;
+    }
+
+    static std::string tarBlock(const std::string& name, uint64_t size, char type) {
+        char header[TAR_BLOCK] = {};
+        std::memcpy(header, name.data(), std::min<size_t>(name.size(), 100));
+        putOctal(header + 100, 8, 0644);
+        putOctal(header + 108, 8, 0);
+        putOctal(header + 116, 8, 0);
+        putOctal(header + 124, 12, size);
+        putOctal(header + 136, 12, static_cast<uint64_t>(std::time(nullptr)));
+        header[156] = type;
+        std::memcpy(header + 257, "ustar", 6);
+        std::memcpy(header + 263, "00", 2);
+        std::memset(header + 148, ' ', 8); // Контрольная сумма считается с пробелами на её месте
+        unsigned checksum = 0;
+        for (unsigned char c : header) checksum += c;
+        std::snprintf(header + 148, 8, "%06o", checksum);
+        header[155] = ' ';
+        return std::string(header, TAR_BLOCK);
+    }
+
+    bool writeAll(const std::string& data) {
+        size_t done = 0;
+        while (done < data.size()) {
+            ssize_t n = write(fd, data.data() + done, data.size() - done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            done += static_cast<size_t>(n);
+        }
+        position += data.size();
+        return true;
+    }
+
+    // Пишет накопленные фрагменты порции, дробя их по IOV_MAX
+    bool writeVector(std::vector<iovec>& parts) {
+        size_t first = 0;
+        while (first < parts.size()) {
+            size_t count = std::min<size_t>(parts.size() - first, IOV_MAX);
+            ssize_t n = writev(fd, parts.data() + first, static_cast<int>(count));
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) return false;
+            position += static_cast<uint64_t>(n);
+            // Пропускаем полностью записанные фрагменты, частично записанный сдвигаем
+            size_t left = static_cast<size_t>(n);
+            while (first < parts.size() && left >= parts[first].iov_len) {
+                left -= parts[first].iov_len;
+                ++first;
+            }
+            if (left > 0) {
+                parts[first].iov_base = static_cast<char*>(parts[first].iov_base) + left;
+                parts[first].iov_len -= left;
+            }
+        }
+        parts.clear();
+        return true;
+    }
+
+    bool openShard() {
+        char file_name[32];
+        std::snprintf(file_name, sizeof(file_name), "shard-%05u.%s", shard_number++, format == Format::Tar ? "tar" : "pack");
+        shard_path = OUTPUT_DIR + "/" + file_name;
+        if (!options.worker.empty()) {
+            // Работники пишут в общий OUTPUT_DIR — имя узла и pid не дают шардам совпасть
+            char host[256] = "worker";
+            gethostname(host, sizeof(host) - 1);
+            shard_path = OUTPUT_DIR + "/" + host + "-" + std::to_string(getpid()) + "-" + file_name;
+        }
+        fd = open(shard_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        position = 0;
+        index.clear();
+        if (fd < 0) {
+            logLine(LogLevel::Error) << "[Archive] Error creating shard: " << shard_path;
+            return false;
+        }
+        return format == Format::Pack ? writeAll(std::string(PACK_MAGIC, 8)) : true;
+    }
+
+    // Дописывает конец архива и индекс, закрывает шард
+    void sealShard() {
+        if (fd < 0) return;
+        if (format == Format::Tar) {
+            writeAll(std::string(2 * TAR_BLOCK, '\0'));
+            std::string listing;
+            for (const auto& entry : index) {
+                listing += entry.name + "\t" + std::to_string(entry.offset) + "\t" + std::to_string(entry.size) + "\n";
+            }
+            int index_fd = open((shard_path + ".idx").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (index_fd >= 0) {
+                size_t done = 0;
+                while (done < listing.size()) {
+                    ssize_t n = write(index_fd, listing.data() + done, listing.size() - done);
+                    if (n <= 0 && errno != EINTR) break;
+                    if (n > 0) done += static_cast<size_t>(n);
+                }
+                if (fsync_mode != FsyncMode::None) fsync(index_fd);
+                ::close(index_fd);
+            }
+        } else {
+            uint64_t index_offset = position;
+            std::string footer;
+            for (const auto& entry : index) {
+                putLE(footer, entry.name.size(), 4);
+                footer += entry.name;
+                putLE(footer, entry.offset, 8);
+                putLE(footer, entry.size, 8);
+            }
+            putLE(footer, index_offset, 8);
+            putLE(footer, index.size(), 8);
+            footer.append(PACK_MAGIC, 8);
+            writeAll(footer);
+        }
+        if (fsync_mode != FsyncMode::None) fsync(fd);
+        ::close(fd);
+        fd = -1;
+        logLine(LogLevel::Info) << "[Archive] Sealed " << shard_path << " (" << index.size() << " entries)";
+    }
+
+public:
+    ArchiveSink(Format format, uint64_t shard_limit, FsyncMode fsync_mode)
+        : format(format), shard_limit(shard_limit), fsync_mode(fsync_mode) {}
+
+    ~ArchiveSink() override { close(); }
+
+    void writeBatch(std::vector<Job>& jobs) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        static const char zeros[TAR_BLOCK] = {};
+        std::vector<iovec> parts;
+        std::deque<std::string> headers; // Заголовки живут до writev; deque не перемещает элементы
+        std::vector<Job*> pending;
+        uint64_t pending_bytes = 0;
+
+        auto flush = [&]() {
+            bool ok = fd >= 0 && writeVector(parts);
+            for (Job* job : pending) job->saved = ok;
+            pending.clear();
+            headers.clear();
+            parts.clear();
+            pending_bytes = 0;
+        };
+
+        for (auto& job : jobs) {
+            if (job.saved) continue;
+            fs::path relative;
+            if (!safeRelativePath(fs::path(job.output_path).lexically_relative(OUTPUT_DIR), relative)) {
+                logLine(LogLevel::Error) << "[Archive] Skipping result outside " << OUTPUT_DIR << ": " << job.output_path;
+                continue;
+            }
+            std::string name = relative.generic_string();
+            uint64_t size = job.encoded.size();
+            std::string header = format == Format::Tar ? tarHeaders(name, size) : std::string();
+            size_t padding = format == Format::Tar ? (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK : 0;
+            uint64_t entry_bytes = header.size() + size + padding;
+
+            // Новый шард, если запись не помещается в текущий (но хотя бы одна запись в шарде всегда есть)
+            if (fd < 0 || (position + pending_bytes + entry_bytes > shard_limit && !index.empty())) {
+                flush();
+                sealShard();
+                if (!openShard()) continue;
+            }
+
+            uint64_t data_offset = position + pending_bytes + header.size();
+            if (!header.empty()) {
+                headers.push_back(std::move(header));
+                parts.push_back({const_cast<char*>(headers.back().data()), headers.back().size()});
+            }
+            parts.push_back({job.encoded.data(), job.encoded.size()});
+            if (padding) parts.push_back({const_cast<char*>(zeros), padding});
+            index.push_back({std::move(name), data_offset, size});
+            pending.push_back(&job);
+            pending_bytes += entry_bytes;
+        }
+        flush();
+        if (fsync_mode != FsyncMode::None && fd >= 0) fsync(fd);
+    }
+
+    void close() override {
+        std::lock_guard<std::mutex> lock(mutex);
+        sealShard();
+    }
+};
+
+std::unique_ptr<OutputSink> output_sink;
+
+// Стадия записи: порцию целиком сохраняет output_sink (в подготовке стадии),
+// затем по каждому заданию сообщается результат и буфер возвращается в пул
+void writeBatch(std::vector<Job>& jobs) {
+    output_sink->writeBatch(jobs);
+}
+
+bool writeStage(Job& job) {
+    if (job.saved) {
+        logLine(LogLevel::Debug) << "[Writer-" << std::this_thread::get_id() << "] Saved image to: " << job.output_path;
+        if (manifest.active()) manifest.record(job.input_path, { job.source_size, job.source_mtime, job.source_hash });
+        job.lease.succeed(job.source_hash);
+        if (job.cache_key != 0) result_cache.store(job);
+        metrics.count(&Metrics::ThreadMetrics::images);
+        metrics.count(&Metrics::ThreadMetrics::bytes_out, job.encoded.size());
+    } else {
+        logLine(LogLevel::Error) << "[Writer-" << std::this_thread::get_id() << "] Error saving image: " << job.output_path;
+    }
+    byte_pool.release(std::move(job.encoded));
+    return true;
+}
+
+// Подстройка числа потоков стадий во время работы. Раз в INTERVAL контроллер смотрит
+// загрузку потоков каждой стадии (доля времени в обработке) и заполненность их очередей:
+// стадия — узкое место, если её потоки заняты почти всё время, перед ней копятся
+// задания, а после неё есть место; ей добавляется поток. Простаивающие стадии теряют
+// по потоку. За такт меняется одна стадия, и если после добавления потока общая
+// пропускная способность упала, изменение откатывается и стадия на время замораживается.
+// Стадии, нагружающие процессор (декодирование, кодирование), вместе не выходят за
+// cpu_budget потоков; стадии ввода-вывода ограничены io_max
+class AutoTuner {
+private:
+    static constexpr auto INTERVAL = std::chrono::milliseconds(500);
+    static constexpr double BUSY = 0.85; // Загрузка, при которой стадии не хватает потоков
+    static constexpr double IDLE = 0.30; // Загрузка, при которой поток лишний
+    static constexpr int FREEZE_TICKS = 10;
 
-        if (queue.empty()) return false; // Если очередь пуста, 
-//возвращаем false
+    struct Watched {
+        Stage* stage;
+        size_t capacity; // Ёмкость входной очереди
+        size_t out_capacity;
+        size_t max_workers;
+        bool cpu_bound;
+        uint64_t busy = 0;
+        int frozen = 0;
+    };
 
-        value = queue.front(); // Получаем элемент из начала очереди
-        queue.pop(); // Удаляем элемент из очереди
-        return true; 
+    std::vector<Watched> stages;
+    size_t cpu_budget = 1;
+    std::thread controller;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+
+    Watched* last_grown = nullptr; // Для отката, если добавление не помогло
+    double last_throughput = 0;
+    uint64_t last_images = 0;
+
+    void tick(double seconds) {
+        uint64_t images = metrics.images();
+        double throughput = (images - last_images) / seconds;
+        last_images = images;
+
+        if (last_grown && throughput < last_throughput * 0.95) {
+            if (last_grown->stage->shrink()) {
+                logLine(LogLevel::Info) << "[Autotune] " << last_grown->stage->getName() << ": rollback to "
+                                        << last_grown->stage->workers() << " workers (" << throughput << " img/s)";
+            }
+            last_grown->frozen = FREEZE_TICKS;
+        }
+        last_grown = nullptr;
+        last_throughput = throughput;
+
+        size_t cpu_workers = 0;
+        for (auto& watched : stages) {
+            if (watched.cpu_bound) cpu_workers += watched.stage->workers();
+        }
+
+        Watched* grow = nullptr;
+        Watched* shrink = nullptr;
+        double grow_util = 0, shrink_util = 1;
+        for (auto& watched : stages) {
+            uint64_t busy = watched.stage->busyNs();
+            size_t workers = std::max<size_t>(1, watched.stage->workers());
+            double util = (busy - watched.busy) / 1e9 / seconds / workers;
+            watched.busy = busy;
+            if (watched.frozen > 0) {
+                --watched.frozen;
+                continue;
+            }
+            bool backlog = watched.stage->inputDepth() * 2 >= watched.capacity;
+            bool room = watched.out_capacity == 0 || watched.stage->outputDepth() < watched.out_capacity;
+            bool allowed = workers < watched.max_workers && (!watched.cpu_bound || cpu_workers < cpu_budget);
+            if (util >= BUSY && backlog && room && allowed && util > grow_util) {
+                grow = &watched;
+                grow_util = util;
+            } else if (util < IDLE && workers > 1 && util < shrink_util) {
+                shrink = &watched;
+                shrink_util = util;
+            }
+        }
+
+        if (grow && grow->stage->grow()) {
+            last_grown = grow;
+            logLine(LogLevel::Info) << "[Autotune] " << grow->stage->getName() << ": " << grow->stage->workers()
+                                    << " workers (busy " << static_cast<int>(grow_util * 100) << "%, queue "
+                                    << grow->stage->inputDepth() << "/" << grow->capacity << ")";
+        } else if (shrink && shrink->stage->shrink()) {
+            logLine(LogLevel::Info) << "[Autotune] " << shrink->stage->getName() << ": " << shrink->stage->workers()
+                                    << " workers (busy " << static_cast<int>(shrink_util * 100) << "%)";
+        }
+    }
+
+public:
+    ~AutoTuner() { stop(); }
+
+    // out_capacity 0 — у стадии нет выходной очереди
+    void watch(Stage& stage, size_t capacity, size_t out_capacity, size_t max_workers, bool cpu_bound) {
+        if (stage.resizable()) stages.push_back({ &stage, capacity, out_capacity, max_workers, cpu_bound });
+    }
+
+    void start(size_t cpu_budget_) {
+        cpu_budget = cpu_budget_;
+        last_images = metrics.images();
+        for (auto& watched : stages) watched.busy = watched.stage->busyNs();
+        controller = std::thread([this] {
+            auto previous = std::chrono::steady_clock::now();
+            std::unique_lock<std::mutex> lock(mutex);
+            while (!wake.wait_for(lock, INTERVAL, [this] { return stopping; })) {
+                auto now = std::chrono::steady_clock::now();
+                tick(std::chrono::duration<double>(now - previous).count());
+                previous = now;
+            }
+        });
     }
 
     void stop() {
-        cond_var.notify_all(); // Уведомляем все потоки, ожидающие в условной переменной
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        if (controller.joinable()) controller.join();
     }
 };
 
-// Константы
-const std::string INPUT_DIR = "input_images";
-const std::string OUTPUT_DIR = "output_images";
-const int NUM_CONSUMERS = 4;
+// Распределённый режим. Координатор (--coordinator PORT) обходит вход, как producer,
+// и раздаёт задания работникам (--worker HOST:PORT) порциями в аренду; работники гонят
+// их через обычный конвейер. Пути передаются как есть — вход и OUTPUT_DIR должны быть
+// видны всем узлам по одним и тем же путям (общая ФС). Протокол — строки текста по TCP:
+//   HELLO имя                     → OK срок_аренды_с хэши(0|1) цепочка
+//   LEASE                         → BATCH id n и n строк заданий | WAIT | DONE
+//   COMPLETE id [индекс:хэш ...]  — какие задания аренды сохранены, без ответа
+//   METRICS ...                   — накопленные метрики работника (Metrics::serialize)
+//   RENEW                         — продление аренд, пока работник занят
+//   BYE
 
-// Очереди
-BlockingQueue<std::pair<std::string, std::string>> task_queue;
+// Строки текста поверх TCP-сокета: буферизованное чтение до '\n', запись целиком
+class LineSocket {
+private:
+    int fd = -1;
+    std::string buffer;
+    size_t start = 0; // Начало непрочитанного в buffer
 
-// Проверка, является ли файл скрытым
-bool isHiddenFile(const std::string& file_name) {
-    return file_name[0] == '.';
+public:
+    explicit LineSocket(int fd) : fd(fd) {
+        if (fd < 0) return;
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)); // Мелкие запросы и ответы
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));  // Пропавший узел обнаружится
+#ifdef SO_NOSIGPIPE
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+    }
+    ~LineSocket() {
+        if (fd >= 0) close(fd);
+    }
+    LineSocket(const LineSocket&) = delete;
+    LineSocket& operator=(const LineSocket&) = delete;
+
+    bool valid() const { return fd >= 0; }
+
+    // false — соединение закрыто или оборвалось
+    bool readLine(std::string& line) {
+        for (;;) {
+            size_t end = buffer.find('\n', start);
+            if (end != std::string::npos) {
+                line.assign(buffer, start, end - start);
+                start = end + 1;
+                return true;
+            }
+            buffer.erase(0, start);
+            start = 0;
+            char chunk[64 * 1024];
+            ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            buffer.append(chunk, static_cast<size_t>(n));
+        }
+    }
+
+    bool send(const std::string& text) {
+#ifdef MSG_NOSIGNAL
+        const int flags = MSG_NOSIGNAL; // Запись в разорванное соединение — ошибка, а не SIGPIPE
+#else
+        const int flags = 0;
+#endif
+        size_t done = 0;
+        while (done < text.size()) {
+            ssize_t n = ::send(fd, text.data() + done, text.size() - done, flags);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            done += static_cast<size_t>(n);
+        }
+        return true;
+    }
+};
+
+// Соединение с HOST:PORT, -1 при ошибке
+int connectTo(const std::string& address) {
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos) return -1;
+    std::string host = address.substr(0, colon), port = address.substr(colon + 1);
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* found = nullptr;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &found) != 0) return -1;
+    int fd = -1;
+    for (addrinfo* candidate = found; candidate && fd < 0; candidate = candidate->ai_next) {
+        fd = socket(candidate->ai_family, candidate->ai_socktype, candidate->ai_protocol);
+        if (fd >= 0 && connect(fd, candidate->ai_addr, candidate->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(found);
+    return fd;
+}
+
+// Задание одной строкой: файл или запись шарда (тогда путь "шард!запись", смещение и длины)
+std::string wireTask(const Job& job) {
+    std::ostringstream line;
+    line << (job.archived ? 'A' : 'F') << '\t' << job.input_path << '\t' << job.output_path << '\t' << job.name << '\t'
+         << job.input_offset << '\t' << job.input_length << '\t' << job.inflated_size << '\n';
+    return line.str();
+}
+
+// Разделители протокола в путях не передать
+bool wireSafe(const Job& job) {
+    for (const std::string* text : { &job.input_path, &job.output_path, &job.name }) {
+        if (text->find_first_of("\t\n") != std::string::npos) return false;
+    }
+    return true;
 }
-// Добавляет задачи в очередь
-void producer(const std::string& input_dir) {
-    for (const auto& entry : fs::directory_iterator(input_dir)) { 
-// Проходим по всем элементам в директории входных изображений
-        if (!entry.is_regular_file()) { 
-            continue; // Пропускаем всё, что не является файлом 
+
+// Работник: берёт у координатора аренды (не больше LEASES_AHEAD сразу) и кладёт задания
+// в task_queue вместо producer. Пока аренды в работе, шлёт RENEW; о каждой завершённой
+// сообщает вместе со своими метриками. После DONE дожидается своих аренд и закрывает очередь
+class WorkerClient {
+private:
+    static constexpr size_t LEASES_AHEAD = 2;
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::vector<std::string> outbox; // Готовые строки COMPLETE
+    size_t outstanding = 0;          // Полученные аренды, о которых ещё не сообщили
+    std::unordered_map<std::string, std::shared_ptr<MappedFile>> shards; // Только поток run()
+
+    // Отображённый шард для записи "шард!запись": шард — первый префикс с расширением архива
+    std::shared_ptr<MappedFile> shardFor(const std::string& input_path) {
+        for (size_t bang = input_path.find('!'); bang != std::string::npos; bang = input_path.find('!', bang + 1)) {
+            std::string path = input_path.substr(0, bang);
+            if (!isArchiveName(path)) continue;
+            auto it = shards.find(path);
+            if (it != shards.end()) return it->second;
+            std::shared_ptr<MappedFile> mapping;
+            int fd = open(path.c_str(), O_RDONLY);
+            struct stat info;
+            if (fd >= 0 && fstat(fd, &info) == 0) mapping = mapFile(fd, static_cast<size_t>(info.st_size));
+            if (fd >= 0) close(fd);
+            shards[path] = mapping;
+            return mapping;
         }
+        return nullptr;
+    }
 
-        std::string file_name = entry.path().filename().string(); // Получаем имя файла
+    bool parseTask(const std::string& line, Job& job) {
+        std::vector<std::string> fields;
+        std::stringstream stream(line);
+        std::string field;
+        while (std::getline(stream, field, '\t')) fields.push_back(field);
+        if (fields.size() != 7 || (fields[0] != "A" && fields[0] != "F")) return false;
+        job.input_path = fields[1];
+        job.output_path = fields[2];
+        job.name = fields[3];
+        if (fields[0] == "A") {
+            job.mapping = shardFor(job.input_path);
+            job.input_offset = std::strtoull(fields[4].c_str(), nullptr, 10);
+            job.input_length = std::strtoull(fields[5].c_str(), nullptr, 10);
+            job.inflated_size = std::strtoull(fields[6].c_str(), nullptr, 10);
+            job.archived = true;
+            if (!job.mapping || job.input_offset + job.input_length > job.mapping->size()) return false;
+        }
+        return true;
+    }
 
-        // Пропускаем скрытые файлы, начинающиеся с точки (.)
-        if (file_name[0] == '.') {
-            std::cout << "[Producer] Skipping hidden or system file: " << file_name << std::endl;
-            continue;
+    void finished(const RemoteLease& lease) {
+        std::ostringstream line;
+        line << "COMPLETE " << lease.id << std::hex;
+        for (size_t i = 0; i < lease.saved.size(); ++i) {
+            if (lease.saved[i]) line << ' ' << std::dec << i << ':' << std::hex << lease.hashes[i];
+        }
+        line << '\n';
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            outbox.push_back(line.str());
+            --outstanding;
+        }
+        changed.notify_all();
+    }
+
+    // Читает n строк аренды и отправляет задания в task_queue; false — оборвалось соединение
+    bool receive(LineSocket& socket, uint64_t id, size_t count) {
+        auto lease = std::make_shared<RemoteLease>();
+        lease->id = id;
+        lease->saved.assign(count, 0);
+        lease->hashes.assign(count, 0);
+        std::vector<Job> jobs;
+        std::string line;
+        for (size_t i = 0; i < count; ++i) {
+            if (!socket.readLine(line)) return false;
+            Job job;
+            if (!parseTask(line, job)) {
+                logLine(LogLevel::Error) << "[Worker] Cannot open leased task: " << line;
+                continue; // Не сохранено — координатор учтёт как ошибку
+            }
+            job.lease = LeaseSlot(lease, i);
+            jobs.push_back(std::move(job));
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ++outstanding;
+        }
+        lease->report = [this](const RemoteLease& done) { finished(done); };
+        lease.reset(); // Дальше аренду держат только задания
+        task_queue.push_bulk(jobs);
+        return true;
+    }
+
+public:
+    // Блокирует, пока координатор не раздаст всё; затем закрывает task_queue
+    void run(const std::string& address) {
+        LineSocket socket(connectTo(address));
+        char host[256] = "worker";
+        gethostname(host, sizeof(host) - 1);
+        std::string line;
+        unsigned long lease_seconds = 0;
+        int hashes = 0;
+        char ops[1024] = "";
+        bool ok = socket.valid() && socket.send("HELLO " + std::string(host) + ":" + std::to_string(getpid()) + "\n")
+               && socket.readLine(line)
+               && std::sscanf(line.c_str(), "OK %lu %d %1023s", &lease_seconds, &hashes, ops) == 3;
+        if (!ok) {
+            logLine(LogLevel::Error) << "[Worker] Cannot connect to coordinator " << address;
+        } else if (options.ops != ops) {
+            logLine(LogLevel::Error) << "[Worker] Coordinator runs --ops " << ops << ", this worker " << options.ops;
+            ok = false;
+        } else {
+            if (hashes) manifest.hashOnly();
+            logLine(LogLevel::Info) << "[Worker] Connected to coordinator " << address;
+        }
+        bool connected = ok;
+
+        auto heartbeat = std::chrono::seconds(std::max<unsigned long>(1, lease_seconds / 3));
+        auto last_sent = std::chrono::steady_clock::now();
+        bool done = false;
+        while (ok) {
+            std::vector<std::string> reports;
+            bool want_lease;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                bool busy = done || outstanding >= LEASES_AHEAD;
+                changed.wait_for(lock, busy ? std::chrono::seconds(1) : std::chrono::seconds(0),
+                                 [this] { return !outbox.empty(); });
+                reports.swap(outbox);
+                want_lease = !done && outstanding < LEASES_AHEAD;
+                if (done && outstanding == 0 && reports.empty()) break;
+            }
+            if (!reports.empty()) {
+                for (const auto& report : reports) ok = ok && socket.send(report);
+                ok = ok && socket.send("METRICS " + metrics.serialize() + "\n");
+                last_sent = std::chrono::steady_clock::now();
+            } else if (!want_lease && std::chrono::steady_clock::now() - last_sent >= heartbeat) {
+                ok = socket.send("RENEW\n");
+                last_sent = std::chrono::steady_clock::now();
+            }
+            if (!ok || !want_lease) continue;
+
+            unsigned long long id = 0;
+            size_t count = 0;
+            ok = socket.send("LEASE\n") && socket.readLine(line);
+            last_sent = std::chrono::steady_clock::now();
+            if (!ok) break;
+            if (line == "DONE") {
+                done = true;
+            } else if (std::sscanf(line.c_str(), "BATCH %llu %zu", &id, &count) == 2) {
+                ok = receive(socket, id, count);
+            } // WAIT: координатор уже подождал работы, спрашиваем снова
+        }
+        if (ok) {
+            socket.send("METRICS " + metrics.serialize() + "\nBYE\n");
+            logLine(LogLevel::Info) << "[Worker] Coordinator has no more tasks";
+        } else if (connected) {
+            logLine(LogLevel::Error) << "[Worker] Lost connection to coordinator " << address;
+        }
+        // Сигнал завершения для стадий, как в producer
+        task_queue.close();
+    }
+};
+
+WorkerClient worker_client;
+
+// Координатор: задания из producer копятся в ready и уходят работникам арендами по
+// lease_batch штук. Аренда продлевается любым сообщением работника; при разрыве соединения
+// или по истечении lease_seconds её задания возвращаются в начало ready и достаются другим.
+// Поздний отчёт по уже переданной аренде игнорируется — результат просто запишется дважды
+class Coordinator {
+private:
+    struct Lease {
+        std::vector<Job> jobs;
+        size_t connection = 0;
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<Job> ready;
+    std::unordered_map<uint64_t, Lease> leases;
+    uint64_t next_lease = 1;
+    size_t connections = 0;     // Открытые соединения работников
+    bool scanned = false;       // producer закончил, task_queue вычерпан
+    uint64_t completed = 0, failed = 0, reassigned = 0;
+
+    std::chrono::steady_clock::time_point leaseDeadline() const {
+        return std::chrono::steady_clock::now() + std::chrono::seconds(options.lease_seconds);
+    }
+
+    // Больше раздавать нечего и никто ничего не держит
+    bool finished() const { return scanned && ready.empty() && leases.empty(); }
+
+    // Задания аренды обратно в начало очереди; под mutex
+    void requeue(Lease& lease) {
+        reassigned += lease.jobs.size();
+        for (auto it = lease.jobs.rbegin(); it != lease.jobs.rend(); ++it) ready.push_front(std::move(*it));
+    }
+
+    // Переносит задания из task_queue, держа в ready не больше QUEUE_CAPACITY
+    void gather() {
+        std::vector<Job> jobs;
+        while (task_queue.pop_bulk(jobs, PRODUCER_BATCH)) {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [this] { return ready.size() < QUEUE_CAPACITY; });
+            for (auto& job : jobs) ready.push_back(std::move(job));
+            changed.notify_all();
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        scanned = true;
+        changed.notify_all();
+    }
+
+    // Раз в секунду возвращает в очередь задания просроченных аренд
+    void reap() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!changed.wait_for(lock, std::chrono::seconds(1), [this] { return finished() && connections == 0; })) {
+            auto now = std::chrono::steady_clock::now();
+            for (auto it = leases.begin(); it != leases.end();) {
+                if (it->second.deadline > now) {
+                    ++it;
+                    continue;
+                }
+                logLine(LogLevel::Warn) << "[Coordinator] Lease " << it->first << " expired, reassigning "
+                                        << it->second.jobs.size() << " tasks";
+                requeue(it->second);
+                it = leases.erase(it);
+                changed.notify_all();
+            }
+        }
+    }
+
+    std::string lease(size_t connection) {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait_for(lock, std::chrono::seconds(1), [this] { return !ready.empty() || finished(); });
+        if (ready.empty()) return finished() ? "DONE\n" : "WAIT\n";
+        uint64_t id = next_lease++;
+        Lease& granted = leases[id];
+        granted.connection = connection;
+        granted.deadline = leaseDeadline();
+        std::string tasks;
+        while (!ready.empty() && granted.jobs.size() < std::max<size_t>(1, options.lease_batch)) {
+            Job job = std::move(ready.front());
+            ready.pop_front();
+            if (!wireSafe(job)) {
+                logLine(LogLevel::Error) << "[Coordinator] Path cannot be sent to workers: " << job.input_path;
+                ++failed;
+                continue;
+            }
+            tasks += wireTask(job);
+            granted.jobs.push_back(std::move(job));
+        }
+        size_t count = granted.jobs.size();
+        if (count == 0) leases.erase(id);
+        changed.notify_all(); // В ready освободилось место для gather
+        return "BATCH " + std::to_string(id) + " " + std::to_string(count) + "\n" + tasks;
+    }
+
+    // COMPLETE id [индекс:хэш ...]: сохранённые попадают в манифест, остальные — ошибки работника
+    void complete(const std::string& line) {
+        std::istringstream in(line.substr(std::strlen("COMPLETE ")));
+        uint64_t id = 0;
+        in >> id;
+        std::unique_lock<std::mutex> lock(mutex);
+        auto it = leases.find(id);
+        if (it == leases.end()) return; // Аренда истекла и передана другому
+        Lease done = std::move(it->second);
+        leases.erase(it);
+        changed.notify_all();
+        lock.unlock();
+
+        std::vector<char> saved(done.jobs.size(), 0);
+        std::string item;
+        while (in >> item) {
+            size_t index = std::strtoull(item.c_str(), nullptr, 10);
+            size_t colon = item.find(':');
+            if (index >= done.jobs.size() || colon == std::string::npos) continue;
+            Job& job = done.jobs[index];
+            saved[index] = 1;
+            if (manifest.active()) {
+                uint64_t hash = std::strtoull(item.c_str() + colon + 1, nullptr, 16);
+                manifest.record(job.input_path, { job.source_size, job.source_mtime, hash != 0 ? hash : job.source_hash });
+            }
+        }
+        size_t ok = static_cast<size_t>(std::count(saved.begin(), saved.end(), 1));
+        lock.lock();
+        completed += ok;
+        failed += done.jobs.size() - ok;
+    }
+
+    void renew(size_t connection) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& item : leases) {
+            if (item.second.connection == connection) item.second.deadline = leaseDeadline();
+        }
+    }
+
+    // Соединение закрыто: недоделанные аренды работника достаются другим
+    void disconnect(size_t connection, const std::string& worker) {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t returned = 0;
+        for (auto it = leases.begin(); it != leases.end();) {
+            if (it->second.connection != connection) {
+                ++it;
+                continue;
+            }
+            returned += it->second.jobs.size();
+            requeue(it->second);
+            it = leases.erase(it);
+        }
+        if (returned != 0) {
+            logLine(LogLevel::Warn) << "[Coordinator] Worker " << worker << " disconnected, reassigning " << returned << " tasks";
+        } else {
+            logLine(LogLevel::Info) << "[Coordinator] Worker " << worker << " finished";
+        }
+        --connections;
+        changed.notify_all();
+    }
+
+    void serve(int fd, size_t connection) {
+        LineSocket socket(fd);
+        std::string line, worker = "#" + std::to_string(connection);
+        while (socket.readLine(line)) {
+            if (line.compare(0, 6, "HELLO ") == 0) {
+                worker = line.substr(6) + "#" + std::to_string(connection);
+                logLine(LogLevel::Info) << "[Coordinator] Worker " << worker << " connected";
+                if (!socket.send("OK " + std::to_string(options.lease_seconds) + " " + (manifest.hashes() ? "1 " : "0 ")
+                                 + options.ops + "\n")) {
+                    break;
+                }
+            } else if (line == "LEASE") {
+                renew(connection);
+                if (!socket.send(lease(connection))) break;
+            } else if (line.compare(0, 9, "COMPLETE ") == 0) {
+                renew(connection);
+                complete(line);
+            } else if (line.compare(0, 8, "METRICS ") == 0) {
+                if (!metrics.merge(worker, line.substr(8))) {
+                    logLine(LogLevel::Warn) << "[Coordinator] Malformed metrics from " << worker;
+                }
+            } else if (line == "RENEW") {
+                renew(connection);
+            } else if (line == "BYE") {
+                break;
+            } else {
+                logLine(LogLevel::Warn) << "[Coordinator] Unknown request from " << worker << ": " << line.substr(0, 64);
+            }
+        }
+        disconnect(connection, worker);
+    }
+
+public:
+    // Блокирует, пока все задания не раздадут и работники не отключатся; false — не удалось слушать порт
+    bool run(unsigned port) {
+        int listener = socket(AF_INET, SOCK_STREAM, 0);
+        int on = 1;
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+        address.sin_port = htons(static_cast<uint16_t>(port));
+        if (listener < 0 || setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0
+            || bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, 64) != 0) {
+            logLine(LogLevel::Error) << "[Coordinator] Cannot listen on port " << port << ": " << std::strerror(errno);
+            if (listener >= 0) close(listener);
+            return false;
+        }
+        logLine(LogLevel::Info) << "[Coordinator] Listening on port " << port;
+
+        metrics.watchQueue("task", [] { return task_queue.size(); });
+        metrics.watchQueue("ready", [this] {
+            std::lock_guard<std::mutex> lock(mutex);
+            return ready.size();
+        });
+        metrics.start(options.metrics_interval, options.metrics_file);
+        task_queue.reopen();
+        std::thread producer_thread(producer, options.input);
+        std::thread gatherer(&Coordinator::gather, this);
+        std::thread reaper(&Coordinator::reap, this);
+
+        std::vector<std::thread> handlers;
+        size_t accepted = 0;
+        for (;;) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (finished() && connections == 0) break;
+            }
+            pollfd waiting{ listener, POLLIN, 0 };
+            if (poll(&waiting, 1, 500) <= 0) continue; // Периодически проверяем, не пора ли закончить
+            int fd = accept(listener, nullptr, nullptr);
+            if (fd < 0) continue;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                ++connections;
+            }
+            handlers.emplace_back(&Coordinator::serve, this, fd, ++accepted);
         }
+        close(listener);
+        for (auto& handler : handlers) handler.join();
+        reaper.join();
+        gatherer.join();
+        producer_thread.join();
+
+        manifest.save();
+        metrics.stop();
+        logLine(LogLevel::Info) << "[Coordinator] " << completed << " tasks completed, " << failed << " failed, "
+                                << reassigned << " reassigned, " << accepted << " worker connections";
+        return true;
+    }
+};
+
+Coordinator coordinator;
+
+// Один прогон конвейера над options.input, время прогона в секундах
+double runPipeline(size_t num_threads, size_t stage_capacity) {
+    auto started = std::chrono::steady_clock::now();
+    FsyncMode fsync_mode = options.fsync == "file" ? FsyncMode::File
+                         : options.fsync == "batch" ? FsyncMode::Batch : FsyncMode::None;
+    if (options.output_format == "files") {
+        output_sink = std::make_unique<FileSink>(fsync_mode, options.direct_io);
+    } else {
+        auto format = options.output_format == "tar" ? ArchiveSink::Format::Tar : ArchiveSink::Format::Pack;
+        output_sink = std::make_unique<ArchiveSink>(format, uint64_t(options.shard_mb) << 20, fsync_mode);
+    }
+
+    // Пул ограничивает число незавершённых задач, чтобы сохранить обратное давление очереди
+    ThreadPool pool(num_threads, options.pin_threads, num_threads * 2);
+    logLine(LogLevel::Info) << "[Main] Using " << pool.size() << " transform threads, "
+              << invertKernel().name << " inversion kernel";
 
-        // Проверка расширения файла на соответствие изображениям
-        std::string ext = entry.path().extension().string();
-        if (ext == ".jpeg" || ext == ".jpg" || ext == ".png") {
-            std::string file_path = entry.path().string(); 
-// Получаем полный путь к файлу
-            std::cout << "[Producer] Adding " << file_name << " to queue" << std::endl;
-            task_queue.push({file_name, file_path}); 
-// Добавляем задачу в очередь 
+    // Очереди между стадиями: чтение → декодирование → преобразование → кодирование → запись
+    JobQueue read_queue(stage_capacity);
+    JobQueue decoded_queue(stage_capacity);
+    JobQueue transformed_queue(stage_capacity);
+    JobQueue encoded_queue(stage_capacity);
+
+    metrics.watchQueue("task", [] { return task_queue.size(); });
+    metrics.watchQueue("read", [&] { return read_queue.size(); });
+    metrics.watchQueue("decoded", [&] { return decoded_queue.size(); });
+    metrics.watchQueue("transformed", [&] { return transformed_queue.size(); });
+    metrics.watchQueue("encoded", [&] { return encoded_queue.size(); });
+    metrics.start(options.metrics_interval, options.metrics_file);
+
+    task_queue.reopen(); // После предыдущего прогона очередь закрыта
+    std::thread producer_thread([] {
+        if (options.worker.empty()) {
+            producer(options.input);
         } else {
-            std::cout << "[Producer] Skipping non-image file: " << file_name << std::endl; 
-            // Пропускаем файлы, которые не являются изображениями
+            worker_client.run(options.worker); // Задания приходят от координатора
+        }
+    });
+    {
+        Stage reader("read", task_queue, &read_queue, options.readers, readOrAwaitStage,
+                     std::max<size_t>(1, options.readahead), submitReads);
+        Stage decoder("decode", read_queue, &decoded_queue, defaultWorkers(options.decoders, 2), decodeStage);
+        Stage transformer("transform", decoded_queue, &transformed_queue, pool,
+                          [&pool](Job& job) { return transformStage(job, pool); });
+        Stage encoder("encode", transformed_queue, &encoded_queue, defaultWorkers(options.encoders, 2), encodeStage);
+        Stage writer("write", encoded_queue, nullptr, options.writers, writeStage,
+                     options.write_batch, writeBatch);
+
+        AutoTuner tuner;
+        if (options.autotune) {
+            size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+            tuner.watch(reader, QUEUE_CAPACITY, stage_capacity, hardware * 4, false);
+            tuner.watch(decoder, stage_capacity, stage_capacity, hardware, true);
+            tuner.watch(encoder, stage_capacity, stage_capacity, hardware, true);
+            tuner.watch(writer, stage_capacity, 0, hardware * 4, false);
+            tuner.start(hardware);
+        }
+        writer.join(); // Запись завершается последней — после неё подстраивать нечего
+        tuner.stop();
+        // Деструкторы остальных стадий дожидаются их потоков
+    }
+
+    // Ожидание завершения производителя
+    producer_thread.join();  
+
+    output_sink->close();
+    manifest.save();
+    metrics.stop();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+}
+
+// Синтетическое изображение: градиенты, крупные фигуры и шум — сжимается похоже на фото,
+// а не как однотонная заливка или чистый шум. Одинаковое для одинаковых seed
+cv::Mat syntheticImage(cv::Size size, uint64_t seed) {
+    cv::Mat image(size, CV_8UC3);
+    for (int y = 0; y < image.rows; ++y) {
+        uchar* row = image.ptr<uchar>(y);
+        for (int x = 0; x < image.cols; ++x) {
+            row[3 * x] = static_cast<uchar>(x * 255 / std::max(1, image.cols - 1));
+            row[3 * x + 1] = static_cast<uchar>(y * 255 / std::max(1, image.rows - 1));
+            row[3 * x + 2] = static_cast<uchar>((x + y + seed * 37) & 0xFF);
         }
     }
+    cv::RNG rng(seed);
+    int radius = std::max(1, std::min(size.width, size.height) / 8);
+    for (int i = 0; i < 8; ++i) {
+        cv::Point center(rng.uniform(0, size.width), rng.uniform(0, size.height));
+        cv::circle(image, center, rng.uniform(1, radius + 1), cv::Scalar(rng.uniform(0, 256), rng.uniform(0, 256), rng.uniform(0, 256)), -1);
+    }
+    cv::Mat noise(size, CV_8UC3);
+    rng.fill(noise, cv::RNG::UNIFORM, 0, 16);
+    image += noise; // С насыщением, как у cv::add
+    return image;
+}
+
+// Список через запятую, например "1,2,4"
+std::vector<size_t> parseSizeList(const std::string& spec) {
+    std::vector<size_t> values;
+    std::stringstream stream(spec);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        if (!item.empty()) values.push_back(std::strtoul(item.c_str(), nullptr, 10));
+    }
+    return values;
+}
 
+// --generate: gen_count изображений в каталог. Размеры "WxH*вес,..." выбираются
+// случайно с весами (по умолчанию в основном мелкие файлы и немного огромных),
+// форматы чередуются. Имена gen_NNNNNNN.ext, набор воспроизводим
+bool generateDataset(const std::string& dir) {
+    struct Variant {
+        cv::Size size;
+        double weight;
+    };
+    std::vector<Variant> variants;
+    std::stringstream stream(options.gen_sizes);
+    std::string item;
+    double total_weight = 0;
+    while (std::getline(stream, item, ',')) {
+        int width = 0, height = 0;
+        double weight = 1.0;
+        if (std::sscanf(item.c_str(), "%dx%d*%lf", &width, &height, &weight) < 2 || width <= 0 || height <= 0 || weight <= 0) {
+            logLine(LogLevel::Error) << "[Generate] Invalid size: " << item;
+            return false;
+        }
+        variants.push_back({ cv::Size(width, height), weight });
+        total_weight += weight;
+    }
+    std::vector<std::string> formats;
+    stream = std::stringstream(options.gen_formats);
+    while (std::getline(stream, item, ',')) formats.push_back("." + item);
+    if (variants.empty() || formats.empty()) return false;
 
-    // Сигнал завершения для Consumers: добавляем пустые задачи для завершения потоков-потребителей
-    for (int i = 0; i < NUM_CONSUMERS; ++i) {
-        task_queue.push({"", ""}); 
+    std::error_code error;
+    fs::create_directories(dir, error);
+    std::atomic<size_t> written{0};
+    std::atomic<uint64_t> bytes{0};
+    ThreadPool pool(defaultWorkers(options.num_threads, 1), false, 0);
+    TaskGroup group(pool);
+    for (size_t i = 0; i < options.gen_count; ++i) {
+        group.run([&, i] {
+            cv::RNG rng(i + 1);
+            double pick = rng.uniform(0.0, total_weight);
+            size_t v = 0;
+            while (v + 1 < variants.size() && pick >= variants[v].weight) pick -= variants[v++].weight;
+            const std::string& ext = formats[i % formats.size()];
+            std::vector<uchar> encoded;
+            if (!cv::imencode(ext, syntheticImage(variants[v].size, i), encoded)) return;
+            char name[32];
+            std::snprintf(name, sizeof(name), "gen_%07zu", i);
+            std::string path = dir + "/" + name + ext;
+            FILE* file = std::fopen(path.c_str(), "wb");
+            if (!file) return;
+            bool ok = std::fwrite(encoded.data(), 1, encoded.size(), file) == encoded.size();
+            ok = std::fclose(file) == 0 && ok;
+            if (ok) {
+                written.fetch_add(1, std::memory_order_relaxed);
+                bytes.fetch_add(encoded.size(), std::memory_order_relaxed);
+            }
+        });
     }
+    try {
+        group.wait();
+    } catch (const std::exception& e) {
+        logLine(LogLevel::Error) << "[Generate] Failed to generate an image: " << e.what();
+    }
+    logLine(LogLevel::Info) << "[Generate] Wrote " << written.load() << " images (" << bytes.load() / (1024 * 1024)
+                            << " MB) to " << dir;
+    return written.load() == options.gen_count;
 }
 
-// Consumer: Обрабатывает задачи из очереди
-void consumer() {
-    while (true) { 
-        std::pair<std::string, std::string> task; 
-        task_queue.pop(task);  // Извлекаем задачу из очереди
+// Результаты --bench построчно в JSON (JSON Lines): одна строка — один замер,
+// чтобы файлы разных коммитов можно было сравнивать построчно
+class BenchWriter {
+private:
+    FILE* out;
+    bool owned;
+
+public:
+    explicit BenchWriter(const std::string& path)
+        : out(path == "-" ? stdout : std::fopen(path.c_str(), "w")), owned(path != "-") {}
+    ~BenchWriter() {
+        if (owned && out) std::fclose(out);
+    }
+    bool ok() const { return out != nullptr; }
 
-        // Сигнал завершения: если задача пустая, выходим из цикла
-        if (task.first.empty() && task.second.empty()) {
-            break;
+    void record(const std::string& bench, const std::vector<std::pair<std::string, std::string>>& params,
+                double value, const char* unit) {
+        std::ostringstream line;
+        line << "{\"bench\":\"" << bench << "\"";
+        for (const auto& param : params) line << ",\"" << param.first << "\":\"" << param.second << "\"";
+        line << ",\"value\":" << value << ",\"unit\":\"" << unit << "\"}";
+        std::fprintf(out, "%s\n", line.str().c_str());
+        std::fflush(out);
+        logLine(LogLevel::Info) << "[Bench] " << line.str();
+    }
+};
+
+double secondsSince(std::chrono::steady_clock::time_point since) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - since).count();
+}
+
+// Пропускная способность очереди: producers потоков кладут items чисел, consumers забирают
+template <typename Queue>
+double queueOpsPerSecond(size_t producers, size_t consumers, size_t capacity, size_t items) {
+    Queue queue(capacity);
+    std::atomic<size_t> remaining_producers{producers};
+    std::vector<std::thread> threads;
+    auto started = std::chrono::steady_clock::now();
+    for (size_t p = 0; p < producers; ++p) {
+        threads.emplace_back([&, p] {
+            for (size_t i = p; i < items; i += producers) queue.push(i);
+            if (remaining_producers.fetch_sub(1) == 1) queue.close();
+        });
+    }
+    for (size_t c = 0; c < consumers; ++c) {
+        threads.emplace_back([&] {
+            size_t value;
+            while (queue.pop(value)) {}
+        });
+    }
+    for (auto& thread : threads) thread.join();
+    return items / secondsSince(started);
+}
+
+// --bench: микробенчмарки очередей, ядер инверсии и кодеков, затем сквозные прогоны
+// конвейера над options.input для каждого сочетания числа потоков и ёмкости очередей
+bool runBenchmarks(const std::string& path) {
+    BenchWriter writer(path);
+    if (!writer.ok()) {
+        logLine(LogLevel::Error) << "[Bench] Cannot open " << path;
+        return false;
+    }
+    size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+
+    const size_t QUEUE_ITEMS = 2000000;
+    for (size_t threads : { size_t(1), size_t(4) }) {
+        for (size_t capacity : { size_t(64), size_t(1024) }) {
+            std::vector<std::pair<std::string, std::string>> params = {
+                { "producers", std::to_string(threads) }, { "consumers", std::to_string(threads) },
+                { "capacity", std::to_string(capacity) } };
+            params.insert(params.begin(), { "queue", "blocking" });
+            writer.record("queue", params, queueOpsPerSecond<BlockingQueue<size_t>>(threads, threads, capacity, QUEUE_ITEMS), "ops/s");
+            params[0].second = "lockfree";
+            writer.record("queue", params, queueOpsPerSecond<LockFreeQueue<size_t>>(threads, threads, capacity, QUEUE_ITEMS), "ops/s");
         }
+    }
+
+    // Ядра инверсии: буфер крупнее кэшей, чтобы мерить пропускную способность памяти
+    std::vector<uchar> buffer(64u << 20, 0x5A);
+    for (const InvertKernel& kernel : availableInvertKernels()) {
+        kernel.fn(buffer.data(), buffer.size()); // Прогрев и заведение страниц
+        const int repeats = 10;
+        auto started = std::chrono::steady_clock::now();
+        for (int i = 0; i < repeats; ++i) kernel.fn(buffer.data(), buffer.size());
+        writer.record("invert_kernel", { { "kernel", kernel.name }, { "buffer_mb", "64" } },
+                      repeats * double(buffer.size()) / secondsSince(started) / 1e9, "GB/s");
+    }
+
+    // Кодеки на кадре 1920x1080; MB/s — по объёму несжатых пикселей
+    cv::Mat frame = syntheticImage(cv::Size(1920, 1080), 1);
+    double frame_mb = frame.total() * frame.elemSize() / 1e6;
+    for (const char* ext : { ".jpg", ".png" }) {
+        const int repeats = 20;
+        std::vector<uchar> encoded;
+        auto started = std::chrono::steady_clock::now();
+        for (int i = 0; i < repeats; ++i) cv::imencode(ext, frame, encoded);
+        double encode_seconds = secondsSince(started) / repeats;
+        cv::Mat decoded;
+        started = std::chrono::steady_clock::now();
+        for (int i = 0; i < repeats; ++i) decoded = cv::imdecode(encoded, cv::IMREAD_UNCHANGED);
+        double decode_seconds = secondsSince(started) / repeats;
+        std::string codec = ext + 1;
+        writer.record("encode", { { "codec", codec }, { "size", "1920x1080" } }, frame_mb / encode_seconds, "MB/s");
+        writer.record("decode", { { "codec", codec }, { "size", "1920x1080" } }, frame_mb / decode_seconds, "MB/s");
+    }
 
-        // Проверка на скрытые файлы внутри consumer
-        if (isHiddenFile(task.first)) {
-            std::cout << "[Consumer-" << std::this_thread::get_id() << "] Skipping hidden file: " << task.first << std::endl;
-            continue; 
+    // Сквозные прогоны: результаты каждого прогона перезаписывают предыдущие
+    std::vector<size_t> thread_counts = parseSizeList(options.bench_threads);
+    if (thread_counts.empty()) {
+        for (size_t n = 1; n < hardware; n *= 2) thread_counts.push_back(n);
+        thread_counts.push_back(hardware);
+    }
+    LogLevel level = options.log_level;
+    logger.setLevel(std::min(level, LogLevel::Warn)); // Сводки прогонов не нужны, замеры пишет writer
+    for (size_t threads : thread_counts) {
+        for (size_t capacity : parseSizeList(options.bench_queues)) {
+            uint64_t before = metrics.images();
+            double seconds = runPipeline(threads, std::max<size_t>(1, capacity));
+            uint64_t images = metrics.images() - before;
+            writer.record("pipeline", { { "threads", std::to_string(threads) }, { "stage_queue", std::to_string(capacity) },
+                                        { "images", std::to_string(images) }, { "ops", options.ops },
+                                        { "autotune", options.autotune ? "on" : "off" } },
+                          images / seconds, "img/s");
         }
+    }
+    logger.setLevel(level);
+    return true;
+}
 
-        std::cout << "[Consumer-" << std::this_thread::get_id() << "] Processing " << task.first << std::endl;
+// --self-check: каждое ядро из availableInvertKernels() сверяется с cv::bitwise_not
+// на невыровненных адресах, длинах с хвостом короче вектора и ROI с разрывами строк.
+// Байты вокруг обрабатываемого участка не должны меняться
+bool runSelfCheck() {
+    const size_t GUARD = 64; // Шире самого широкого вектора (AVX-512)
+    std::vector<size_t> lengths;
+    for (size_t n = 0; n <= 2 * 256 + 1; ++n) lengths.push_back(n); // Все хвосты и развёрнутые циклы
+    for (size_t n : { size_t(4093), size_t(65537), size_t(1u << 20) + 13 }) lengths.push_back(n);
 
-        // Обработка изображения с использованием OpenCV
-        cv::Mat image = cv::imread(task.second); 
-        if (image.empty()) { 
-            std::cerr << "[Consumer-" << std::this_thread::get_id() << "] Error reading image: " << task.second << std::endl;
-            continue; 
+    cv::RNG rng(0x5E1F);
+    size_t failures = 0, cases = 0;
+    for (const InvertKernel& kernel : availableInvertKernels()) {
+        size_t kernel_failures = 0;
+        for (size_t length : lengths) {
+            for (size_t offset = 0; offset < GUARD; offset += length > 4096 ? 7 : 1) {
+                cv::Mat buffer(1, static_cast<int>(length + offset + GUARD), CV_8U);
+                rng.fill(buffer, cv::RNG::UNIFORM, 0, 256);
+                cv::Mat expected = buffer.clone();
+                if (length != 0) {
+                    cv::Mat part = expected(cv::Rect(static_cast<int>(offset), 0, static_cast<int>(length), 1));
+                    cv::bitwise_not(part, part);
+                }
+                kernel.fn(buffer.data + offset, length);
+                ++cases;
+                if (std::memcmp(buffer.data, expected.data, buffer.total()) != 0) {
+                    if (kernel_failures++ < 8) {
+                        logLine(LogLevel::Error) << "[SelfCheck] " << kernel.name << ": mismatch at offset " << offset
+                                                 << ", length " << length;
+                    }
+                }
+            }
+        }
+        // ROI нечётной ширины внутри кадра: строки не непрерывны, invertInPlace идёт построчно
+        for (int type : { CV_8UC1, CV_8UC3, CV_8UC4, CV_16UC1, CV_16UC3 }) {
+            for (int width : { 1, 7, 31, 33, 65, 127, 301 }) {
+                cv::Mat frame(19, width + 9, type);
+                rng.fill(frame, cv::RNG::UNIFORM, 0, CV_MAT_DEPTH(type) == CV_16U ? 65536 : 256);
+                cv::Mat expected = frame.clone();
+                cv::Rect area(3, 2, width, 15);
+                cv::Mat expected_roi = expected(area);
+                cv::bitwise_not(expected_roi, expected_roi);
+                cv::Mat roi = frame(area);
+                invertInPlace(roi, kernel.fn);
+                ++cases;
+                if (std::memcmp(frame.data, expected.data, frame.total() * frame.elemSize()) != 0) {
+                    if (kernel_failures++ < 8) {
+                        logLine(LogLevel::Error) << "[SelfCheck] " << kernel.name << ": ROI mismatch, type " << type
+                                                 << ", width " << width;
+                    }
+                }
+            }
         }
+        logLine(kernel_failures ? LogLevel::Error : LogLevel::Info)
+            << "[SelfCheck] Kernel " << kernel.name << ": " << (kernel_failures ? "FAILED" : "ok");
+        failures += kernel_failures;
+    }
+    logLine(failures ? LogLevel::Error : LogLevel::Info)
+        << "[SelfCheck] " << cases << " cases, " << failures << " mismatches";
+    return failures == 0;
+}
 
-        cv::Mat inverted_image; 
-        cv::bitwise_not(image, inverted_image);  // Инвертируем цвета изображения
+void printUsage(const char* program) {
+    std::cerr << "Usage: " << program << " [--threads N] [--pin] [--readers N] [--decoders N]"
+              << " [--encoders N] [--writers N] [--tile-rows N] [--tile-threshold PIXELS]"
+              << " [--ops invert,gray,resize=WxH,bc=ALPHA:BETA,blur=K] [--pool-mb N]"
+              << " [--readahead N] [--no-mmap] [--io-uring] [--write-batch N]"
+              << " [--fsync none|file|batch] [--direct-io] [--output-format files|tar|pack]"
+              << " [--shard-mb N] [--input DIR|SHARD] [--scanners N]"
+              << " [--incremental off|stat|hash] [--resume] [--dedupe] [--cache-mb N] [--jpeg-dct] [--gpu off|opencl]"
+              << " [--watch [--watch-settle MS] [--watch-interval SECONDS]]"
+              << " [--coordinator PORT | --worker HOST:PORT] [--lease-batch N] [--lease-seconds N]"
+              << " [--metrics-interval SECONDS] [--metrics-file PATH] [--log-level error|warn|info|debug]"
+              << " [--stage-queue N] [--no-autotune] [--schedule lpt|fifo] [--schedule-window N] [--memory-mb N] [--probe]"
+              << " [--generate DIR [--gen-count N] [--gen-sizes WxH*WEIGHT,...] [--gen-formats jpg,png]]"
+              << " [--bench FILE|- [--bench-threads N,...] [--bench-queues N,...]] [--self-check]" << std::endl;
+}
 
-        std::string output_path = OUTPUT_DIR + "/inverted_" + task.first; 
-        if (cv::imwrite(output_path, inverted_image)) { 
-            std::cout << "[Consumer-" << std::this_thread::get_id() << "] Saved inverted image to: " << output_path << std::endl;
+// Разбор аргументов командной строки, false при ошибке
+bool parseOptions(int argc, char** argv, Options& opts) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--threads" && has_value) {
+            opts.num_threads = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--pin") {
+            opts.pin_threads = true;
+        } else if (arg == "--readers" && has_value) {
+            opts.readers = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--decoders" && has_value) {
+            opts.decoders = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--encoders" && has_value) {
+            opts.encoders = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--writers" && has_value) {
+            opts.writers = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--tile-rows" && has_value) {
+            opts.tile_rows = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--tile-threshold" && has_value) {
+            opts.tile_threshold = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--ops" && has_value) {
+            opts.ops = argv[++i];
+        } else if (arg == "--pool-mb" && has_value) {
+            opts.pool_mb = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--readahead" && has_value) {
+            opts.readahead = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--no-mmap") {
+            opts.use_mmap = false;
+        } else if (arg == "--io-uring") {
+            opts.use_io_uring = true;
+        } else if (arg == "--write-batch" && has_value) {
+            opts.write_batch = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--fsync" && has_value) {
+            opts.fsync = argv[++i];
+            if (opts.fsync != "none" && opts.fsync != "file" && opts.fsync != "batch") {
+                std::cerr << "Unknown --fsync mode: " << opts.fsync << std::endl;
+                return false;
+            }
+        } else if (arg == "--direct-io") {
+            opts.direct_io = true;
+        } else if (arg == "--output-format" && has_value) {
+            opts.output_format = argv[++i];
+            if (opts.output_format != "files" && opts.output_format != "tar" && opts.output_format != "pack") {
+                std::cerr << "Unknown --output-format: " << opts.output_format << std::endl;
+                return false;
+            }
+        } else if (arg == "--shard-mb" && has_value) {
+            opts.shard_mb = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--input" && has_value) {
+            opts.input = argv[++i];
+        } else if (arg == "--scanners" && has_value) {
+            opts.scanners = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--incremental" && has_value) {
+            opts.incremental = argv[++i];
+            if (opts.incremental != "off" && opts.incremental != "stat" && opts.incremental != "hash") return false;
+        } else if (arg == "--dedupe") {
+            opts.dedupe = true;
+        } else if (arg == "--watch") {
+            opts.watch = true;
+        } else if (arg == "--watch-settle" && has_value) {
+            opts.watch_settle_ms = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--watch-interval" && has_value) {
+            opts.watch_interval = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--resume") {
+            opts.resume = true;
+        } else if (arg == "--jpeg-dct") {
+            opts.jpeg_dct = true;
+        } else if (arg == "--coordinator" && has_value) {
+            opts.coordinator_port = static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+            if (opts.coordinator_port == 0 || opts.coordinator_port > 65535) return false;
+        } else if (arg == "--worker" && has_value) {
+            opts.worker = argv[++i];
+            if (opts.worker.find(':') == std::string::npos) return false;
+        } else if (arg == "--lease-batch" && has_value) {
+            opts.lease_batch = std::max<size_t>(1, std::strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--lease-seconds" && has_value) {
+            opts.lease_seconds = std::max<size_t>(1, std::strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--gpu" && has_value) {
+            opts.gpu = argv[++i];
+            if (opts.gpu != "off" && opts.gpu != "opencl") return false;
+        } else if (arg == "--metrics-interval" && has_value) {
+            opts.metrics_interval = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--metrics-file" && has_value) {
+            opts.metrics_file = argv[++i];
+        } else if (arg == "--log-level" && has_value) {
+            std::string level = argv[++i];
+            if (level == "error") opts.log_level = LogLevel::Error;
+            else if (level == "warn") opts.log_level = LogLevel::Warn;
+            else if (level == "info") opts.log_level = LogLevel::Info;
+            else if (level == "debug") opts.log_level = LogLevel::Debug;
+            else return false;
+        } else if (arg == "--no-autotune") {
+            opts.autotune = false;
+        } else if (arg == "--schedule" && has_value) {
+            opts.schedule = argv[++i];
+            if (opts.schedule != "lpt" && opts.schedule != "fifo") return false;
+        } else if (arg == "--schedule-window" && has_value) {
+            opts.schedule_window = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--memory-mb" && has_value) {
+            opts.memory_mb = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--probe") {
+            opts.probe = true;
+        } else if (arg == "--stage-queue" && has_value) {
+            opts.stage_queue = std::max<size_t>(1, std::strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--generate" && has_value) {
+            opts.generate = argv[++i];
+        } else if (arg == "--gen-count" && has_value) {
+            opts.gen_count = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--gen-sizes" && has_value) {
+            opts.gen_sizes = argv[++i];
+        } else if (arg == "--gen-formats" && has_value) {
+            opts.gen_formats = argv[++i];
+        } else if (arg == "--bench" && has_value) {
+            opts.bench = argv[++i];
+        } else if (arg == "--bench-threads" && has_value) {
+            opts.bench_threads = argv[++i];
+        } else if (arg == "--bench-queues" && has_value) {
+            opts.bench_queues = argv[++i];
+        } else if (arg == "--self-check") {
+            opts.self_check = true;
+        } else if (arg == "--cache-mb" && has_value) {
+            opts.cache_mb = std::strtoul(argv[++i], nullptr, 10);
         } else {
-            std::cerr << "[Consumer-" << std::this_thread::get_id() << "] Error saving image: " << output_path << std::endl;
+            std::cerr << "Unknown argument: " << arg << std::endl;
+            return false;
         }
     }
-
-    std::cout << "[Consumer-" << std::this_thread::get_id() << "] Exiting" << std::endl; 
+    if (opts.resume && opts.incremental == "off") opts.incremental = "stat"; // Журнал ведёт манифест
+    if (opts.coordinator_port != 0 && !opts.worker.empty()) {
+        std::cerr << "--coordinator and --worker are mutually exclusive" << std::endl;
+        return false;
+    }
+    return true;
 }
 
+int main(int argc, char** argv) {
+    if (!parseOptions(argc, argv, options)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    std::string chain_error;
+    if (!transform_chain.parse(options.ops, chain_error)) {
+        std::cerr << "Invalid --ops: " << chain_error << std::endl;
+        return 1;
+    }
+    transform_chain.compile();
+    logger.setLevel(options.log_level);
+    logger.start();
+#ifndef HAVE_IO_URING
+    if (options.use_io_uring) {
+        logLine(LogLevel::Warn) << "[Main] Built without io_uring support (-DUSE_IO_URING), using synchronous I/O";
+        options.use_io_uring = false;
+    }
+#endif
+    frame_pool.setCacheLimit(options.pool_mb * 1024 * 1024);
+    memory_budget.setLimit(options.memory_mb * 1024 * 1024);
 
-int main() {
     // Создаем выходную директорию, если её нет
     if (!fs::exists(OUTPUT_DIR)) { 
         fs::create_directory(OUTPUT_DIR); 
     }
 
-    // Запускаем потоки: производитель и потребители
-    std::thread producer_thread(producer, INPUT_DIR); 
-    std::vector<std::thread> consumer_threads; 
-    for (int i = 0; i < NUM_CONSUMERS; ++i) { 
-        consumer_threads.emplace_back(consumer); 
- // Создаем потоки-потребители и добавляем их в вектор потоков
+    if (options.watch && fs::is_regular_file(options.input)) {
+        logLine(LogLevel::Warn) << "[Main] --watch needs a directory as input, processing " << options.input << " once";
+        options.watch = false;
+    }
+    if (options.watch) {
+        // Результаты внутри наблюдаемого входа снова попадали бы на вход
+        std::error_code error;
+        fs::path input = fs::weakly_canonical(options.input, error), output = fs::weakly_canonical(OUTPUT_DIR, error);
+        if (std::mismatch(input.begin(), input.end(), output.begin(), output.end()).first == input.end()) {
+            logLine(LogLevel::Error) << "[Main] --watch needs " << OUTPUT_DIR << " outside the input directory";
+            logger.stop();
+            return 1;
+        }
     }
 
-    // Ожидание завершения всех потоков: производителя и потребителей
-    producer_thread.join();  
-    for (auto& thread : consumer_threads) { 
-        thread.join();  
+    if (options.incremental != "off" && !options.worker.empty()) {
+        logLine(LogLevel::Warn) << "[Main] --incremental is handled by the coordinator, ignored on a worker";
+    } else if (options.incremental != "off") {
+        if (options.output_format == "files") {
+            manifest.load(OUTPUT_DIR + "/.manifest", options.ops, options.incremental == "hash");
+        } else {
+            // Шарды пишутся заново при каждом запуске — пропущенные входы в них бы не попали
+            logLine(LogLevel::Warn) << "[Main] --incremental requires --output-format files, processing everything";
+        }
+    }
+
+    if (options.jpeg_dct && !transform_chain.invertOnly()) {
+        logLine(LogLevel::Warn) << "[Main] --jpeg-dct applies only to --ops invert, using the pixel path";
+        options.jpeg_dct = false;
+    }
+#ifndef HAVE_JPEG
+    if (options.jpeg_dct) {
+        logLine(LogLevel::Warn) << "[Main] Built without libjpeg (-DUSE_JPEG_DCT), --jpeg-dct is ignored";
+        options.jpeg_dct = false;
+    }
+#endif
+    if (options.gpu == "opencl") {
+        if (gpu.enable()) {
+            logLine(LogLevel::Info) << "[Main] OpenCL device: " << gpu.deviceName();
+        } else {
+            logLine(LogLevel::Warn) << "[Main] OpenCL is not available, transforms run on the CPU";
+        }
     }
+    if (options.dedupe) result_cache.configure(options.cache_mb << 20, options.ops);
 
-    std::cout << "[Main] All tasks completed" << std::endl; 
+    if (!options.generate.empty()) {
+        bool ok = generateDataset(options.generate);
+        logger.stop();
+        return ok ? 0 : 1;
+    }
+    if (options.self_check) {
+        bool ok = runSelfCheck();
+        logger.stop();
+        return ok ? 0 : 1;
+    }
+    if (!options.bench.empty()) {
+        bool ok = runBenchmarks(options.bench);
+        logger.stop();
+        return ok ? 0 : 1;
+    }
+    if (options.coordinator_port != 0) {
+        bool ok = coordinator.run(options.coordinator_port);
+        logger.stop();
+        return ok ? 0 : 1;
+    }
+
+    runPipeline(defaultWorkers(options.num_threads, 1), options.stage_queue);
+    if (options.dedupe) logLine(LogLevel::Info) << "[Main] Result cache hits: " << result_cache.hitCount();
+    if (gpu.active()) gpu.report();
+
+    FramePool::Stats pool_stats = frame_pool.stats();
+    logLine(LogLevel::Info) << "[Main] Frame pool: " << pool_stats.hits << " hits, " << pool_stats.misses << " misses ("
+              << static_cast<int>(pool_stats.hitRate() * 100) << "% hit rate), peak "
+              << pool_stats.peak_bytes / (1024 * 1024) << " MB";
+    if (memory_budget.limited()) {
+        logLine(LogLevel::Info) << "[Main] Peak decoded memory reserved: " << memory_budget.peakBytes() / (1024 * 1024) << " MB";
+    }
+    logLine(LogLevel::Info) << "[Main] All tasks completed";
+    logger.stop();
     return 0;  
 }
-